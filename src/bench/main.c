@@ -0,0 +1,843 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * systray-bench starts a tray under its own Xvfb and docks N synthetic
+ * clients into it. The clients speak just enough of the tray and XEmbed
+ * protocols to be embedded: a window with _XEMBED_INFO and WM_NAME that
+ * sends a dock request to the selection owner. They live on a separate
+ * X connection of this process, which is indistinguishable from another
+ * application for the tray.
+ *
+ * With --layout, it measures the allocation of a box filled with N icons
+ * instead, without any clients.
+ *
+ * With --animate, the clients have ARGB windows and the first one redraws
+ * itself at 10 fps. It counts how often each icon is composited onto the
+ * tray meanwhile, and fails if any of the idle icons was composited too.
+ *
+ * The results are printed to stdout as one JSON object.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include <gtk/gtk.h>
+
+#include "systray.h"
+#include "systray-box.h"
+#include "systray-socket.h"
+
+#define BENCH_CLIENTS_DEFAULT "1,10,100,1000"
+#define BENCH_ICONS_DEFAULT "100,250,500,1000,2000"
+
+/* allocations timed per layout run, and the icon geometry there */
+#define BENCH_LAYOUT_ITERATIONS (50)
+#define BENCH_LAYOUT_ICON_SIZE (22)
+#define BENCH_LAYOUT_WIDE_EVERY (7)
+
+/* time without relayout after which the tray counts as settled */
+#define BENCH_SETTLE_QUIET (100 * G_TIME_SPAN_MILLISECOND)
+
+/* upper bound for every phase, per client */
+#define BENCH_TIMEOUT_PER_CLIENT (20 * G_TIME_SPAN_MILLISECOND)
+#define BENCH_TIMEOUT_MIN (5 * G_TIME_SPAN_SECOND)
+
+/* the animated icon redraws itself this often */
+#define BENCH_ANIMATE_FRAMES (20)
+#define BENCH_ANIMATE_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+/* milliseconds between two wakeups of the main loop */
+#define BENCH_HEARTBEAT_INTERVAL (10)
+
+#define XEMBED_MAPPED (1 << 0)
+
+
+typedef struct {
+    /* connection of the synthetic clients */
+    Display *xdisplay;
+    Atom opcode_atom;
+    Atom selection_atom;
+    Atom xembed_info_atom;
+
+    /* the tray under test */
+    GtkWidget *window;
+    GtkWidget *tray;
+    GtkWidget *box;
+
+    /* client windows of the current run, and when they asked to dock */
+    guint n_clients;
+    Window *windows;
+    gboolean argb;
+    GHashTable *sent;
+
+    /* dock latencies in microseconds, in the order they were docked */
+    GArray *latencies;
+
+    guint n_removed;
+    gint64 last_allocation;
+    gint64 last_removal;
+} Bench;
+
+
+typedef gboolean (*BenchDoneFunc)(Bench *bench);
+
+
+/* main loop responsiveness, see bench_heartbeat */
+static gint64 bench_last_beat = 0;
+static gint64 bench_max_stall = 0;
+
+static gchar *opt_clients = NULL;
+static gchar *opt_display = NULL;
+static gchar *opt_xvfb = NULL;
+static gboolean opt_layout = FALSE;
+static gboolean opt_animate = FALSE;
+static gint opt_max_fps = 0;
+static gint opt_dock_settle = 0;
+static gchar *opt_icons = NULL;
+
+static GOptionEntry bench_options[] = {
+    {"clients", 'n', 0, G_OPTION_ARG_STRING, &opt_clients,
+     "Comma separated client counts (default " BENCH_CLIENTS_DEFAULT ")", "N,..."},
+    {"display", 'd', 0, G_OPTION_ARG_STRING, &opt_display,
+     "Use a running X server instead of starting Xvfb", "DISPLAY"},
+    {"xvfb", 0, 0, G_OPTION_ARG_FILENAME, &opt_xvfb,
+     "Xvfb binary to start (default Xvfb)", "PATH"},
+    {"layout", 0, 0, G_OPTION_ARG_NONE, &opt_layout,
+     "Benchmark the box allocation instead of docking", NULL},
+    {"animate", 0, 0, G_OPTION_ARG_NONE, &opt_animate,
+     "Benchmark compositing while one icon animates at 10 fps", NULL},
+    {"dock-settle", 0, 0, G_OPTION_ARG_INT, &opt_dock_settle,
+     "Milliseconds the tray collects docking icons (default 0)", "MS"},
+    {"max-fps", 0, 0, G_OPTION_ARG_INT, &opt_max_fps,
+     "Repaint limit per icon for --animate (default none)", "FPS"},
+    {"icons", 0, 0, G_OPTION_ARG_STRING, &opt_icons,
+     "Comma separated icon counts for --layout (default " BENCH_ICONS_DEFAULT ")",
+     "N,..."},
+    {NULL}
+};
+
+
+static glong
+bench_rss_kib(void) {
+    glong size = 0, resident = 0;
+    FILE *file;
+
+    file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(file);
+
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+static gint
+bench_compare_int64(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static gint64
+bench_percentile(GArray *sorted, guint percent) {
+    if (sorted->len == 0) {
+        return -1;
+    }
+
+    return g_array_index(sorted, gint64, (sorted->len - 1) * percent / 100);
+}
+
+
+static void
+bench_sleep(gint64 span) {
+    gint64 deadline = g_get_monotonic_time() + span;
+
+    /* keep the tray running meanwhile */
+    while (g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+
+static gboolean
+bench_wait(Bench *bench, BenchDoneFunc done) {
+    gint64 deadline;
+
+    deadline = g_get_monotonic_time() +
+               MAX(BENCH_TIMEOUT_MIN, bench->n_clients * BENCH_TIMEOUT_PER_CLIENT);
+
+    /* the heartbeat source in main () makes sure we wake up regularly */
+    while (!done(bench)) {
+        if (g_get_monotonic_time() > deadline) {
+            return FALSE;
+        }
+
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    return TRUE;
+}
+
+
+static gboolean
+bench_heartbeat(gpointer user_data) {
+    gint64 now = g_get_monotonic_time();
+
+    /* the longest the main loop was kept from running the heartbeat, which
+     * is also how long the tray couldn't draw a frame */
+    if (bench_last_beat != 0) {
+        bench_max_stall = MAX(bench_max_stall,
+                              now - bench_last_beat - BENCH_HEARTBEAT_INTERVAL * 1000);
+    }
+    bench_last_beat = now;
+
+    return TRUE;
+}
+
+
+static gboolean
+bench_registered(Bench *bench) {
+    return systray_get_registered_time(SYSTRAY(bench->tray)) != 0;
+}
+
+
+static gboolean
+bench_docked(Bench *bench) {
+    return bench->latencies->len == bench->n_clients;
+}
+
+
+static gboolean
+bench_settled(Bench *bench) {
+    return g_get_monotonic_time() - bench->last_allocation > BENCH_SETTLE_QUIET;
+}
+
+
+static gboolean
+bench_undocked(Bench *bench) {
+    return bench->n_removed == bench->n_clients;
+}
+
+
+static void
+bench_box_add(GtkContainer *box, GtkWidget *child, Bench *bench) {
+    gpointer sent;
+    gint64 latency;
+
+    sent = g_hash_table_lookup(bench->sent, GUINT_TO_POINTER(
+                                   systray_socket_get_window(SYSTRAY_SOCKET(child))));
+    if (sent != NULL) {
+        latency = g_get_monotonic_time() - *(gint64 *)sent;
+        g_array_append_val(bench->latencies, latency);
+    }
+}
+
+
+static void
+bench_box_remove(GtkContainer *box, GtkWidget *child, Bench *bench) {
+    bench->n_removed++;
+    bench->last_removal = g_get_monotonic_time();
+}
+
+
+static void
+bench_box_size_allocate(GtkWidget *box, GtkAllocation *allocation, Bench *bench) {
+    bench->last_allocation = g_get_monotonic_time();
+}
+
+
+static gboolean
+bench_client_events(GIOChannel *channel, GIOCondition condition, gpointer user_data) {
+    Bench *bench = user_data;
+    XEvent xevent;
+
+    /* the clients don't care about embed notifications, but the server
+     * must not queue them up forever */
+    while (XPending(bench->xdisplay)) {
+        XNextEvent(bench->xdisplay, &xevent);
+    }
+
+    return TRUE;
+}
+
+
+static Window
+bench_client_new(Bench *bench, guint index) {
+    Window window;
+    XVisualInfo vinfo;
+    XSetWindowAttributes attrs;
+    gulong info[2] = {0, XEMBED_MAPPED};
+    gchar *name;
+
+    if (bench->argb && XMatchVisualInfo(bench->xdisplay, DefaultScreen(bench->xdisplay),
+                                        32, TrueColor, &vinfo)) {
+        /* a transparent window the tray has to composite */
+        attrs.colormap = XCreateColormap(bench->xdisplay, DefaultRootWindow(bench->xdisplay),
+                                         vinfo.visual, AllocNone);
+        attrs.background_pixel = 0;
+        attrs.border_pixel = 0;
+        window = XCreateWindow(bench->xdisplay, DefaultRootWindow(bench->xdisplay),
+                               0, 0, 16, 16, 0, vinfo.depth, InputOutput, vinfo.visual,
+                               CWColormap | CWBackPixel | CWBorderPixel, &attrs);
+    } else {
+        window = XCreateSimpleWindow(bench->xdisplay, DefaultRootWindow(bench->xdisplay),
+                                     0, 0, 16, 16, 0, 0, 0);
+    }
+
+    XChangeProperty(bench->xdisplay, window, bench->xembed_info_atom,
+                    bench->xembed_info_atom, 32, PropModeReplace, (guchar *)info, 2);
+
+    name = g_strdup_printf("bench-client-%04u", index);
+    XStoreName(bench->xdisplay, window, name);
+    g_free(name);
+
+    return window;
+}
+
+
+static void
+bench_client_dock(Bench *bench, Window window, Window owner) {
+    XClientMessageEvent xevent;
+
+    memset(&xevent, 0, sizeof(xevent));
+    xevent.type = ClientMessage;
+    xevent.window = owner;
+    xevent.message_type = bench->opcode_atom;
+    xevent.format = 32;
+    xevent.data.l[0] = CurrentTime;
+    xevent.data.l[1] = 0; /* SYSTEM_TRAY_REQUEST_DOCK */
+    xevent.data.l[2] = window;
+
+    XSendEvent(bench->xdisplay, owner, False, NoEventMask, (XEvent *)&xevent);
+}
+
+
+static void
+bench_json_separate(GString *json) {
+    if (json->len > 0 && json->str[json->len - 1] == '}') {
+        g_string_append(json, ",");
+    }
+}
+
+
+static void
+bench_exposes(Bench *bench, guint64 *n_exposes, guint64 *n_merged) {
+    SystraySocketStats stats;
+    GList *children, *li;
+
+    *n_exposes = *n_merged = 0;
+
+    /* the sockets don't outlive their clients, so this is read while docked */
+    children = gtk_container_get_children(GTK_CONTAINER(bench->box));
+    for (li = children; li != NULL; li = li->next) {
+        systray_socket_get_stats(SYSTRAY_SOCKET(li->data), &stats);
+        *n_exposes += stats.n_exposes;
+        *n_merged += stats.n_exposes_merged;
+    }
+    g_list_free(children);
+}
+
+
+static gboolean
+bench_run_dock(Bench *bench, guint n_clients, GString *json) {
+    Window owner;
+    gint64 start, undock_start, max_stall, *sent;
+    glong rss_idle, rss_docked, rss_undocked;
+    SystrayBoxStats stats_start, stats_docked;
+    guint64 n_exposes, n_exposes_merged, n_batches, batch_max;
+    gboolean docked, undocked;
+    guint i;
+
+    bench->n_clients = n_clients;
+    bench->windows = g_new0(Window, n_clients);
+    bench->argb = FALSE;
+    bench->sent = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    bench->latencies = g_array_sized_new(FALSE, FALSE, sizeof(gint64), n_clients);
+    bench->n_removed = 0;
+    bench->last_allocation = 0;
+    bench->last_removal = 0;
+
+    /* create all clients before timing anything */
+    for (i = 0; i < n_clients; i++) {
+        bench->windows[i] = bench_client_new(bench, i);
+    }
+    XSync(bench->xdisplay, False);
+
+    rss_idle = bench_rss_kib();
+
+    owner = XGetSelectionOwner(bench->xdisplay, bench->selection_atom);
+    g_return_val_if_fail(owner != None, FALSE);
+
+    systray_box_get_stats(SYSTRAY_BOX(bench->box), &stats_start);
+    systray_reset_dock_stats(SYSTRAY(bench->tray));
+
+    /* all clients dock at once, like at session start */
+    bench_max_stall = 0;
+    start = g_get_monotonic_time();
+    for (i = 0; i < n_clients; i++) {
+        sent = g_new(gint64, 1);
+        *sent = g_get_monotonic_time();
+        g_hash_table_insert(bench->sent, GUINT_TO_POINTER(bench->windows[i]), sent);
+
+        bench_client_dock(bench, bench->windows[i], owner);
+        XFlush(bench->xdisplay);
+    }
+
+    docked = bench_wait(bench, bench_docked);
+    bench_wait(bench, bench_settled);
+    max_stall = bench_max_stall;
+    systray_get_dock_stats(SYSTRAY(bench->tray), &n_batches, &batch_max);
+
+    rss_docked = bench_rss_kib();
+    systray_box_get_stats(SYSTRAY_BOX(bench->box), &stats_docked);
+    bench_exposes(bench, &n_exposes, &n_exposes_merged);
+
+    /* clients going away, the tray has to notice and clean up */
+    undock_start = g_get_monotonic_time();
+    for (i = 0; i < n_clients; i++) {
+        XDestroyWindow(bench->xdisplay, bench->windows[i]);
+    }
+    XFlush(bench->xdisplay);
+
+    undocked = bench_wait(bench, bench_undocked);
+    bench_wait(bench, bench_settled);
+
+    rss_undocked = bench_rss_kib();
+
+    g_array_sort(bench->latencies, bench_compare_int64);
+
+    bench_json_separate(json);
+
+    g_string_append_printf(json,
+        "\n    {\"clients\": %u, \"docked\": %u, \"complete\": %s,"
+        " \"dock_latency_us\": {\"p50\": %" G_GINT64_FORMAT ", \"p90\": %" G_GINT64_FORMAT
+        ", \"p99\": %" G_GINT64_FORMAT ", \"max\": %" G_GINT64_FORMAT "},"
+        " \"settle_us\": %" G_GINT64_FORMAT ", \"undock_us\": %" G_GINT64_FORMAT ","
+        " \"dock_allocations\": %" G_GUINT64_FORMAT ", \"max_stall_us\": %" G_GINT64_FORMAT ","
+        " \"dock_batches\": %" G_GUINT64_FORMAT ", \"dock_batch_max_us\": %" G_GUINT64_FORMAT ","
+        " \"exposes\": %" G_GUINT64_FORMAT ", \"exposes_merged\": %" G_GUINT64_FORMAT ","
+        " \"rss_kib\": {\"idle\": %ld, \"docked\": %ld, \"undocked\": %ld}}",
+        n_clients, bench->latencies->len, (docked && undocked) ? "true" : "false",
+        bench_percentile(bench->latencies, 50), bench_percentile(bench->latencies, 90),
+        bench_percentile(bench->latencies, 99), bench_percentile(bench->latencies, 100),
+        bench->last_allocation > start ? bench->last_allocation - start : -1,
+        bench->last_removal > undock_start ? bench->last_removal - undock_start : -1,
+        stats_docked.n_size_allocates - stats_start.n_size_allocates, MAX(max_stall, 0),
+        n_batches, batch_max, n_exposes, n_exposes_merged, rss_idle, rss_docked, rss_undocked);
+
+    g_array_free(bench->latencies, TRUE);
+    g_hash_table_destroy(bench->sent);
+    g_free(bench->windows);
+
+    return docked && undocked;
+}
+
+
+static void
+bench_composites(Bench *bench, Window animated, SystraySocketStats *animated_stats,
+        guint64 *n_others, gboolean *composited) {
+    SystraySocketStats stats;
+    GList *children, *li;
+
+    memset(animated_stats, 0, sizeof(*animated_stats));
+    *n_others = 0;
+    *composited = FALSE;
+
+    children = gtk_container_get_children(GTK_CONTAINER(bench->box));
+    for (li = children; li != NULL; li = li->next) {
+        systray_socket_get_stats(SYSTRAY_SOCKET(li->data), &stats);
+        if (systray_socket_get_window(SYSTRAY_SOCKET(li->data)) == animated) {
+            *animated_stats = stats;
+            *composited = systray_socket_is_composited(SYSTRAY_SOCKET(li->data));
+        } else {
+            *n_others += stats.n_composites;
+        }
+    }
+    g_list_free(children);
+}
+
+
+static gboolean
+bench_run_animate(Bench *bench, guint n_clients, GString *json) {
+    Window owner;
+    GC gc;
+    gint64 *sent;
+    SystraySocketStats animated_start, animated_end;
+    guint64 others_start, others_end;
+    gboolean docked, undocked, composited;
+    guint i;
+
+    bench->n_clients = n_clients;
+    bench->windows = g_new0(Window, n_clients);
+    bench->argb = TRUE;
+    bench->sent = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    bench->latencies = g_array_sized_new(FALSE, FALSE, sizeof(gint64), n_clients);
+    bench->n_removed = 0;
+    bench->last_allocation = 0;
+    bench->last_removal = 0;
+
+    for (i = 0; i < n_clients; i++) {
+        bench->windows[i] = bench_client_new(bench, i);
+    }
+    XSync(bench->xdisplay, False);
+
+    owner = XGetSelectionOwner(bench->xdisplay, bench->selection_atom);
+    g_return_val_if_fail(owner != None, FALSE);
+
+    for (i = 0; i < n_clients; i++) {
+        sent = g_new(gint64, 1);
+        *sent = g_get_monotonic_time();
+        g_hash_table_insert(bench->sent, GUINT_TO_POINTER(bench->windows[i]), sent);
+
+        bench_client_dock(bench, bench->windows[i], owner);
+    }
+    XFlush(bench->xdisplay);
+
+    docked = bench_wait(bench, bench_docked);
+    bench_wait(bench, bench_settled);
+    bench_sleep(BENCH_ANIMATE_INTERVAL);
+
+    bench_composites(bench, bench->windows[0], &animated_start, &others_start, &composited);
+
+    /* the first client redraws its whole window every frame, which damages
+     * nothing but its own icon */
+    gc = XCreateGC(bench->xdisplay, bench->windows[0], 0, NULL);
+    for (i = 0; i < BENCH_ANIMATE_FRAMES; i++) {
+        XSetForeground(bench->xdisplay, gc, (i % 2 == 0) ? 0x80ff0000 : 0x800000ff);
+        XFillRectangle(bench->xdisplay, bench->windows[0], gc, 0, 0, 64, 64);
+        XFlush(bench->xdisplay);
+
+        bench_sleep(BENCH_ANIMATE_INTERVAL);
+    }
+    XFreeGC(bench->xdisplay, gc);
+
+    bench_composites(bench, bench->windows[0], &animated_end, &others_end, &composited);
+
+    for (i = 0; i < n_clients; i++) {
+        XDestroyWindow(bench->xdisplay, bench->windows[i]);
+    }
+    XFlush(bench->xdisplay);
+
+    undocked = bench_wait(bench, bench_undocked);
+    bench_wait(bench, bench_settled);
+
+    bench_json_separate(json);
+
+    g_string_append_printf(json,
+        "\n    {\"clients\": %u, \"complete\": %s, \"composited\": %s, \"frames\": %d,"
+        " \"max_fps\": %d, \"animated_damages\": %" G_GUINT64_FORMAT ","
+        " \"animated_damages_coalesced\": %" G_GUINT64_FORMAT ","
+        " \"animated_composites\": %" G_GUINT64_FORMAT ","
+        " \"other_composites\": %" G_GUINT64_FORMAT "}",
+        n_clients, (docked && undocked) ? "true" : "false", composited ? "true" : "false",
+        BENCH_ANIMATE_FRAMES, opt_max_fps,
+        animated_end.n_damages - animated_start.n_damages,
+        animated_end.n_damages_coalesced - animated_start.n_damages_coalesced,
+        animated_end.n_composites - animated_start.n_composites, others_end - others_start);
+
+    g_array_free(bench->latencies, TRUE);
+    g_hash_table_destroy(bench->sent);
+    g_free(bench->windows);
+
+    /* only the animated icon may be painted again, an idle one repainted
+     * along with it means the draw handler ignores the clip */
+    if (!composited) {
+        g_printerr("The animated icon was not composited, nothing was checked\n");
+        return FALSE;
+    }
+    if (others_end != others_start) {
+        g_printerr("Idle icons were composited %" G_GUINT64_FORMAT " times while "
+                   "another one animated\n", others_end - others_start);
+        return FALSE;
+    }
+
+    return docked && undocked;
+}
+
+
+static GPid
+bench_spawn_xvfb(void) {
+    gchar *argv[] = {opt_xvfb != NULL ? opt_xvfb : "Xvfb", "-displayfd", NULL,
+                     "-screen", "0", "1920x1080x24", "-nolisten", "tcp", NULL};
+    GError *error = NULL;
+    gchar number[16];
+    gchar *display;
+    gint fds[2];
+    gssize n, length = 0;
+    GPid pid;
+
+    if (pipe(fds) != 0) {
+        g_printerr("Unable to create a pipe for Xvfb\n");
+        return 0;
+    }
+
+    /* Xvfb picks a free display and writes its number to the pipe */
+    argv[2] = g_strdup_printf("%d", fds[1]);
+    if (!g_spawn_async(NULL, argv, NULL,
+                       G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN |
+                       G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, NULL, &pid, &error)) {
+        g_printerr("Unable to start Xvfb: %s\n", error->message);
+        g_error_free(error);
+        g_free(argv[2]);
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    g_free(argv[2]);
+    close(fds[1]);
+
+    while (length < (gssize)sizeof(number) - 1 &&
+           (n = read(fds[0], number + length, sizeof(number) - 1 - length)) > 0) {
+        length += n;
+        if (number[length - 1] == '\n') break;
+    }
+    close(fds[0]);
+
+    number[length] = '\0';
+    g_strchomp(number);
+    if (length == 0) {
+        g_printerr("Xvfb did not report a display\n");
+        kill(pid, SIGTERM);
+        g_spawn_close_pid(pid);
+        return 0;
+    }
+
+    display = g_strdup_printf(":%s", number);
+    g_setenv("DISPLAY", display, TRUE);
+    g_free(display);
+
+    return pid;
+}
+
+
+static void
+bench_run_layout(guint n_icons, GString *json) {
+    GtkWidget *window, *box, *socket;
+    GtkAllocation allocation;
+    GtkRequisition requisition;
+    SystrayBoxStats stats;
+    GdkScreen *screen;
+    GdkVisual *visual;
+    gint64 start, elapsed;
+    guint i;
+
+    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    box = systray_box_new();
+    gtk_container_add(GTK_CONTAINER(window), box);
+
+    /* two rows of icons */
+    systray_box_set_size_alloc(SYSTRAY_BOX(box), 2 * BENCH_LAYOUT_ICON_SIZE + 4);
+
+    /* sockets without a client, with the size an icon would request.
+     * every few icons is a wide one */
+    screen = gtk_widget_get_screen(window);
+    visual = gdk_screen_get_system_visual(screen);
+    for (i = 0; i < n_icons; i++) {
+        socket = systray_socket_new(screen, None, visual);
+        gtk_widget_set_size_request(socket,
+                                    (i % BENCH_LAYOUT_WIDE_EVERY == 0 ? 2 : 1) *
+                                        BENCH_LAYOUT_ICON_SIZE,
+                                    BENCH_LAYOUT_ICON_SIZE);
+        gtk_container_add(GTK_CONTAINER(box), socket);
+        gtk_widget_show(socket);
+    }
+
+    gtk_widget_get_preferred_size(box, NULL, &requisition);
+
+    /* too narrow for the icons at full size, so the row size has to be
+     * searched for */
+    allocation.x = allocation.y = 0;
+    allocation.width = n_icons * BENCH_LAYOUT_ICON_SIZE / 3;
+    allocation.height = requisition.height;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCH_LAYOUT_ITERATIONS; i++) {
+        /* a slightly different width each time, like a panel being resized */
+        allocation.width += (i % 2 == 0) ? 1 : -1;
+        gtk_widget_size_allocate(box, &allocation);
+    }
+    elapsed = (g_get_monotonic_time() - start) / BENCH_LAYOUT_ITERATIONS;
+
+    systray_box_get_stats(SYSTRAY_BOX(box), &stats);
+
+    bench_json_separate(json);
+    g_string_append_printf(json,
+        "\n    {\"icons\": %u, \"allocate_us\": %" G_GINT64_FORMAT ","
+        " \"allocate_ns_per_icon\": %" G_GINT64_FORMAT ", \"allocations\": %" G_GUINT64_FORMAT ","
+        " \"restarts\": %" G_GUINT64_FORMAT ", \"child_allocations\": %" G_GUINT64_FORMAT ","
+        " \"child_allocations_skipped\": %" G_GUINT64_FORMAT ","
+        " \"child_requests\": %" G_GUINT64_FORMAT "}",
+        n_icons, elapsed, elapsed * 1000 / MAX(n_icons, 1), stats.n_size_allocates,
+        stats.n_allocation_restarts, stats.n_child_allocations,
+        stats.n_child_allocations_skipped, stats.n_child_requests);
+
+    gtk_widget_destroy(window);
+}
+
+
+static gboolean
+bench_layout(GString *json) {
+    gchar **counts;
+    guint i, n;
+
+    counts = g_strsplit(opt_icons != NULL ? opt_icons : BENCH_ICONS_DEFAULT, ",", -1);
+    for (i = 0; counts[i] != NULL; i++) {
+        n = (guint)g_ascii_strtoull(counts[i], NULL, 10);
+        if (n > 0) {
+            bench_run_layout(n, json);
+        }
+    }
+    g_strfreev(counts);
+
+    return TRUE;
+}
+
+
+static gboolean
+bench_dock(GString *json) {
+    GIOChannel *channel;
+    GList *children;
+    gchar **counts;
+    gchar *selection_name;
+    Bench bench;
+    gboolean complete = TRUE;
+    guint i, n;
+
+    memset(&bench, 0, sizeof(bench));
+
+    /* the tray registers as soon as it is realized */
+    bench.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    bench.tray = systray_new();
+    g_object_set(G_OBJECT(bench.tray), "fast-start", TRUE,
+                 "icon-max-fps", (guint)MAX(opt_max_fps, 0),
+                 "dock-settle", (guint)MAX(opt_dock_settle, 0),
+                 "icon-cache", FALSE, NULL);
+    gtk_container_add(GTK_CONTAINER(bench.window), bench.tray);
+    gtk_widget_show_all(bench.window);
+
+    /* the box is the first child of the tray */
+    children = gtk_container_get_children(GTK_CONTAINER(bench.tray));
+    bench.box = children != NULL ? children->data : NULL;
+    g_list_free(children);
+    g_return_val_if_fail(IS_SYSTRAY_BOX(bench.box), FALSE);
+
+    g_signal_connect(G_OBJECT(bench.box), "add", G_CALLBACK(bench_box_add), &bench);
+    g_signal_connect(G_OBJECT(bench.box), "remove", G_CALLBACK(bench_box_remove), &bench);
+    g_signal_connect(G_OBJECT(bench.box), "size-allocate",
+                     G_CALLBACK(bench_box_size_allocate), &bench);
+
+    if (!bench_wait(&bench, bench_registered)) {
+        g_printerr("The tray did not acquire the selection\n");
+        return FALSE;
+    }
+
+    /* connection of the synthetic clients */
+    bench.xdisplay = XOpenDisplay(NULL);
+    g_return_val_if_fail(bench.xdisplay != NULL, FALSE);
+
+    bench.opcode_atom = XInternAtom(bench.xdisplay, "_NET_SYSTEM_TRAY_OPCODE", False);
+    bench.xembed_info_atom = XInternAtom(bench.xdisplay, "_XEMBED_INFO", False);
+    selection_name = g_strdup_printf("_NET_SYSTEM_TRAY_S%d",
+                                     DefaultScreen(bench.xdisplay));
+    bench.selection_atom = XInternAtom(bench.xdisplay, selection_name, False);
+    g_free(selection_name);
+
+    channel = g_io_channel_unix_new(ConnectionNumber(bench.xdisplay));
+    g_io_add_watch(channel, G_IO_IN, bench_client_events, &bench);
+    g_io_channel_unref(channel);
+
+    counts = g_strsplit(opt_clients != NULL ? opt_clients : BENCH_CLIENTS_DEFAULT, ",", -1);
+    for (i = 0; counts[i] != NULL; i++) {
+        n = (guint)g_ascii_strtoull(counts[i], NULL, 10);
+        if (n > 0 && opt_animate) {
+            complete = bench_run_animate(&bench, n, json) && complete;
+        } else if (n > 0) {
+            complete = bench_run_dock(&bench, n, json) && complete;
+        }
+    }
+    g_strfreev(counts);
+
+    XCloseDisplay(bench.xdisplay);
+    gtk_widget_destroy(bench.window);
+
+    return complete;
+}
+
+
+int
+main(int argc, char **argv) {
+    GOptionContext *context;
+    GError *error = NULL;
+    GString *json;
+    GPid xvfb = 0;
+    gboolean complete;
+
+    context = g_option_context_new("- benchmark the tray");
+    g_option_context_add_main_entries(context, bench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (opt_display != NULL) {
+        g_setenv("DISPLAY", opt_display, TRUE);
+    } else if ((xvfb = bench_spawn_xvfb()) == 0) {
+        return EXIT_FAILURE;
+    }
+
+    gtk_init(&argc, &argv);
+
+    g_timeout_add(BENCH_HEARTBEAT_INTERVAL, bench_heartbeat, NULL);
+
+    json = g_string_new(NULL);
+
+    if (opt_layout) {
+        complete = bench_layout(json);
+    } else {
+        complete = bench_dock(json);
+    }
+
+    g_print("{\n  \"benchmark\": \"%s\",\n  \"results\": [%s\n  ]\n}\n",
+            opt_layout ? "layout" : (opt_animate ? "animate" : "dock"), json->str);
+    g_string_free(json, TRUE);
+
+    if (xvfb != 0) {
+        kill(xvfb, SIGTERM);
+        g_spawn_close_pid(xvfb);
+    }
+
+    return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+}
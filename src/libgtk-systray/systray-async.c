@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+
+#include <X11/Xlib-xcb.h>
+#include <X11/Xlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include <gdk/gdk.h>
+#include <gdk/gdkx.h>
+#include <gtk/gtk.h>
+
+#include "systray-async.h"
+
+
+typedef struct _SystrayAsync SystrayAsync;
+typedef struct _SystrayAsyncRequest SystrayAsyncRequest;
+
+
+struct _SystrayAsync {
+    GSource __parent__;
+
+    /* xcb connection underneath the xlib display of gdk */
+    xcb_connection_t *connection;
+    GPollFD poll_fd;
+
+    /* requests waiting for a reply, in the order they were sent */
+    GQueue requests;
+
+    /* requests sent through this source, for statistics */
+    guint64 n_requests;
+};
+
+
+struct _SystrayAsyncRequest {
+    guint sequence;
+
+    /* NULL when the request has been cancelled */
+    SystrayAsyncFunc func;
+    gpointer user_data;
+
+    /* reply or error, once it arrived */
+    gpointer reply;
+    xcb_generic_error_t *error;
+    guint done : 1;
+};
+
+
+static gboolean systray_async_prepare(GSource *source, gint *timeout);
+
+static gboolean systray_async_check(GSource *source);
+
+static gboolean systray_async_dispatch(GSource *source, GSourceFunc callback,
+        gpointer user_data);
+
+static void systray_async_finalize(GSource *source);
+
+
+static GSourceFuncs systray_async_source_funcs = {
+    systray_async_prepare,
+    systray_async_check,
+    systray_async_dispatch,
+    systray_async_finalize,
+};
+
+
+static GQuark
+systray_async_quark(void) {
+    static GQuark q = 0;
+
+    if (q == 0) {
+        q = g_quark_from_static_string("systray-async");
+    }
+
+    return q;
+}
+
+
+static void
+systray_async_request_free(SystrayAsyncRequest *request) {
+    free(request->reply);
+    free(request->error);
+    g_slice_free(SystrayAsyncRequest, request);
+}
+
+
+static gboolean
+systray_async_poll(SystrayAsync *async) {
+    SystrayAsyncRequest *request;
+
+    /* replies arrive in request order, so only the oldest request can
+     * be complete if any is */
+    request = g_queue_peek_head(&async->requests);
+    if (request == NULL) {
+        return FALSE;
+    }
+
+    if (!request->done) {
+        request->done = xcb_poll_for_reply(async->connection, request->sequence,
+                                           &request->reply, &request->error);
+    }
+
+    return request->done;
+}
+
+
+static gboolean
+systray_async_prepare(GSource *source, gint *timeout) {
+    *timeout = -1;
+
+    /* gdk may already have read our replies off the socket */
+    return systray_async_poll((SystrayAsync *)source);
+}
+
+
+static gboolean
+systray_async_check(GSource *source) {
+    return systray_async_poll((SystrayAsync *)source);
+}
+
+
+static gboolean
+systray_async_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+    SystrayAsync *async = (SystrayAsync *)source;
+    SystrayAsyncRequest *request;
+
+    /* deliver all the replies that are available */
+    while (systray_async_poll(async)) {
+        /* take the request off the queue first, the callback might cancel
+         * or add requests */
+        request = g_queue_pop_head(&async->requests);
+
+        if (request->func != NULL) {
+            request->func(request->reply, request->error, request->user_data);
+        }
+
+        systray_async_request_free(request);
+    }
+
+    return TRUE;
+}
+
+
+static void
+systray_async_finalize(GSource *source) {
+    SystrayAsync *async = (SystrayAsync *)source;
+    SystrayAsyncRequest *request;
+
+    /* the connection is gone with the display, just drop the bookkeeping */
+    while ((request = g_queue_pop_head(&async->requests)) != NULL) {
+        systray_async_request_free(request);
+    }
+}
+
+
+static void
+systray_async_destroy(gpointer data) {
+    GSource *source = data;
+
+    g_source_destroy(source);
+    g_source_unref(source);
+}
+
+
+static SystrayAsync *
+systray_async_get(GdkDisplay *display) {
+    SystrayAsync *async;
+
+    async = g_object_get_qdata(G_OBJECT(display), systray_async_quark());
+    if (G_LIKELY(async != NULL)) {
+        return async;
+    }
+
+    /* one source per display, watching the connection of gdk */
+    async = (SystrayAsync *)g_source_new(&systray_async_source_funcs,
+                                         sizeof(SystrayAsync));
+    async->connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(display));
+    g_queue_init(&async->requests);
+    async->n_requests = 0;
+
+    async->poll_fd.fd = xcb_get_file_descriptor(async->connection);
+    async->poll_fd.events = G_IO_IN;
+    g_source_add_poll((GSource *)async, &async->poll_fd);
+
+    g_source_set_priority((GSource *)async, GDK_PRIORITY_EVENTS);
+    g_source_set_can_recurse((GSource *)async, TRUE);
+    g_source_attach((GSource *)async, NULL);
+
+    g_object_set_qdata_full(G_OBJECT(display), systray_async_quark(), async,
+                            systray_async_destroy);
+
+    return async;
+}
+
+
+xcb_connection_t *
+systray_async_get_connection(GdkDisplay *display) {
+    g_return_val_if_fail(GDK_IS_DISPLAY(display), NULL);
+
+    return systray_async_get(display)->connection;
+}
+
+
+void
+systray_async_add(GdkDisplay *display, guint sequence, SystrayAsyncFunc func,
+                  gpointer user_data) {
+    SystrayAsync *async;
+    SystrayAsyncRequest *request;
+
+    g_return_if_fail(GDK_IS_DISPLAY(display));
+    g_return_if_fail(func != NULL);
+
+    async = systray_async_get(display);
+
+    request = g_slice_new0(SystrayAsyncRequest);
+    request->sequence = sequence;
+    request->func = func;
+    request->user_data = user_data;
+
+    g_queue_push_tail(&async->requests, request);
+    async->n_requests++;
+}
+
+
+static void
+systray_async_cancel_func(gpointer data, gpointer user_data) {
+    SystrayAsyncRequest *request = data;
+
+    /* the reply still has to be read, but nobody gets to see it */
+    if (request->user_data == user_data) {
+        request->func = NULL;
+    }
+}
+
+
+void
+systray_async_cancel(GdkDisplay *display, gpointer user_data) {
+    SystrayAsync *async;
+
+    g_return_if_fail(GDK_IS_DISPLAY(display));
+
+    async = g_object_get_qdata(G_OBJECT(display), systray_async_quark());
+    if (async != NULL) {
+        g_queue_foreach(&async->requests, systray_async_cancel_func, user_data);
+    }
+}
+
+
+void
+systray_async_flush(GdkDisplay *display) {
+    g_return_if_fail(GDK_IS_DISPLAY(display));
+
+    xcb_flush(systray_async_get(display)->connection);
+}
+
+
+guint64
+systray_async_get_n_requests(GdkDisplay *display) {
+    SystrayAsync *async;
+
+    g_return_val_if_fail(GDK_IS_DISPLAY(display), 0);
+
+    async = g_object_get_qdata(G_OBJECT(display), systray_async_quark());
+
+    return async != NULL ? async->n_requests : 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SYSTRAY_ASYNC_H__
+#define __SYSTRAY_ASYNC_H__
+
+#include <xcb/xcb.h>
+
+#include <gdk/gdkx.h>
+#include <gtk/gtk.h>
+
+/* called from the main loop once the reply (or error) for a request has
+ * arrived. both are freed after the callback returns */
+typedef void (*SystrayAsyncFunc)(gpointer reply, xcb_generic_error_t *error,
+                                 gpointer user_data);
+
+xcb_connection_t *systray_async_get_connection(GdkDisplay *display);
+
+void systray_async_add(GdkDisplay *display, guint sequence, SystrayAsyncFunc func,
+                       gpointer user_data);
+
+void systray_async_cancel(GdkDisplay *display, gpointer user_data);
+
+void systray_async_flush(GdkDisplay *display);
+
+guint64 systray_async_get_n_requests(GdkDisplay *display);
+
+#endif /* !__SYSTRAY_ASYNC_H__ */
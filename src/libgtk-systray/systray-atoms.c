@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <X11/Xlib.h>
+
+#include <gdk/gdk.h>
+#include <gdk/gdkx.h>
+#include <gtk/gtk.h>
+
+#include "systray-atoms.h"
+
+
+/* indexed by SystrayAtom */
+static const gchar *
+systray_atom_names[SYSTRAY_N_ATOMS] = {
+    "MANAGER",
+    "_NET_SYSTEM_TRAY_OPCODE",
+    "_NET_SYSTEM_TRAY_MESSAGE_DATA",
+    "_NET_SYSTEM_TRAY_ORIENTATION",
+    "_NET_SYSTEM_TRAY_VISUAL",
+    "_NET_WM_NAME",
+    "UTF8_STRING",
+    "WM_NAME",
+    "STRING",
+    "WM_CLASS",
+    "_XEMBED_INFO",
+};
+
+
+static GQuark
+systray_atoms_quark(void) {
+    static GQuark q = 0;
+
+    if (q == 0) {
+        q = g_quark_from_static_string("systray-atoms");
+    }
+
+    return q;
+}
+
+
+const Atom *
+systray_atoms_get(GdkDisplay *display) {
+    Atom *atoms;
+
+    g_return_val_if_fail(GDK_IS_DISPLAY(display), NULL);
+
+    /* atoms are interned once and live as long as the display */
+    atoms = g_object_get_qdata(G_OBJECT(display), systray_atoms_quark());
+    if (G_LIKELY(atoms != NULL)) {
+        return atoms;
+    }
+
+    /* intern all atoms the library uses in a single round trip */
+    atoms = g_new0(Atom, SYSTRAY_N_ATOMS);
+    XInternAtoms(GDK_DISPLAY_XDISPLAY(display), (gchar **)systray_atom_names,
+                 SYSTRAY_N_ATOMS, False, atoms);
+
+    g_object_set_qdata_full(G_OBJECT(display), systray_atoms_quark(), atoms,
+                            g_free);
+
+    return atoms;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SYSTRAY_ATOMS_H__
+#define __SYSTRAY_ATOMS_H__
+
+#include <X11/Xlib.h>
+
+#include <gdk/gdkx.h>
+#include <gtk/gtk.h>
+
+/* keep in sync with systray_atom_names in systray-atoms.c */
+typedef enum {
+    SYSTRAY_ATOM_MANAGER,
+    SYSTRAY_ATOM_NET_SYSTEM_TRAY_OPCODE,
+    SYSTRAY_ATOM_NET_SYSTEM_TRAY_MESSAGE_DATA,
+    SYSTRAY_ATOM_NET_SYSTEM_TRAY_ORIENTATION,
+    SYSTRAY_ATOM_NET_SYSTEM_TRAY_VISUAL,
+    SYSTRAY_ATOM_NET_WM_NAME,
+    SYSTRAY_ATOM_UTF8_STRING,
+    SYSTRAY_ATOM_WM_NAME,
+    SYSTRAY_ATOM_STRING,
+    SYSTRAY_ATOM_WM_CLASS,
+    SYSTRAY_ATOM_XEMBED_INFO,
+    SYSTRAY_N_ATOMS
+} SystrayAtom;
+
+const Atom *systray_atoms_get(GdkDisplay *display);
+
+#endif /* !__SYSTRAY_ATOMS_H__ */
@@ -39,6 +39,11 @@ static void systray_box_finalize(GObject *object);
 
 static void systray_box_size_request(GtkWidget *widget, GtkRequisition *requisition);
 
+static void systray_box_child_visible_changed(GtkWidget *child, GParamSpec *pspec,
+        SystrayBox *box);
+
+static void systray_box_child_request_changed(GtkWidget *child, SystrayBox *box);
+
 static void systray_box_get_preferred_width(GtkWidget *widget, gint *minimal_width,
         gint *natural_width);
 
@@ -61,7 +66,8 @@ static gint systray_box_compare_function(gconstpointer a, gconstpointer b);
 
 enum {
     PROP_0,
-    PROP_HAS_HIDDEN
+    PROP_HAS_HIDDEN,
+    PROP_STATS
 };
 
 
@@ -70,11 +76,64 @@ struct _SystrayBoxClass {
 };
 
 
+/* an icon in the box, with everything the layout needs to know about it */
+typedef struct {
+    GtkWidget *widget;
+
+    /* preferred size, asked for again after the child queued a resize, and
+     * the length along the rows relative to the row size */
+    GtkRequisition req;
+    gdouble ratio;
+
+    /* collation key of the name, updated with systray_box_update and
+     * systray_box_update_child */
+    gchar *sort_key;
+
+    /* last allocation, and the size request it was made for */
+    GtkAllocation alloc;
+    GtkRequisition alloc_req;
+
+    guint hidden : 1;
+    guint visible : 1;
+    guint req_valid : 1;
+
+    /* alloc has been given to the widget */
+    guint allocated : 1;
+
+    /* parked offscreen instead of packed */
+    guint offscreen : 1;
+} SystrayBoxChild;
+
+
+/* a placed icon in the spatial index */
+typedef struct {
+    GtkWidget *widget;
+    GdkRectangle rect;
+} SystrayBoxIndexEntry;
+
+
+/* a row of the spatial index, covering the entries first to first + n - 1 */
+typedef struct {
+    gint line, size;
+    guint first, n;
+} SystrayBoxIndexRow;
+
+
+/* bounds and current position of the packer, along (pos) and across
+ * (line) the rows */
+typedef struct {
+    gint rows;
+    gint pos, pos_start, pos_end;
+    gint line, line_start, line_end;
+} SystrayBoxPacker;
+
+
 struct _SystrayBox {
     GtkContainer __parent__;
 
-    /* all the icons packed in this box */
-    GSList *childeren;
+    /* all the icons packed in this box, in sort order. every widget knows
+     * its index from its qdata */
+    GArray *children;
 
     /* orientation of the box */
     guint horizontal : 1;
@@ -91,12 +150,51 @@ struct _SystrayBox {
 
     /* allocated size by the plugin */
     gint size_alloc;
+
+    /* requisition without the border, valid until something affecting it
+     * changes or a child asks for a new size */
+    GtkRequisition requisition;
+    guint requisition_valid : 1;
+
+    /* placed icons by row and by position in the row, rebuilt on every
+     * allocation and dropped when an icon goes away */
+    GArray *index;
+    GArray *index_rows;
+    guint index_valid : 1;
+
+    /* while frozen, children are appended unsorted and the box is sorted
+     * and resized once on thaw */
+    guint freeze_count;
+    guint sort_pending : 1;
+    guint resize_pending : 1;
+
+    /* counters, only copied out when somebody asks */
+    SystrayBoxStats stats;
 };
 
 
+static GQuark systray_box_index_quark;
+
+
 G_DEFINE_TYPE(SystrayBox, systray_box, GTK_TYPE_CONTAINER)
 
 
+static SystrayBoxStats *
+systray_box_stats_copy(const SystrayBoxStats *stats) {
+    return g_slice_dup(SystrayBoxStats, stats);
+}
+
+
+static void
+systray_box_stats_free(SystrayBoxStats *stats) {
+    g_slice_free(SystrayBoxStats, stats);
+}
+
+
+G_DEFINE_BOXED_TYPE(SystrayBoxStats, systray_box_stats, systray_box_stats_copy,
+                    systray_box_stats_free)
+
+
 static void
 systray_box_class_init(SystrayBoxClass *klass) {
     GObjectClass *gobject_class;
@@ -118,8 +216,14 @@ systray_box_class_init(SystrayBoxClass *klass) {
     gtkcontainer_class->forall = systray_box_forall;
     gtkcontainer_class->child_type = systray_box_child_type;
 
+    systray_box_index_quark = g_quark_from_static_string("systray-box-index");
+
     g_object_class_install_property(gobject_class, PROP_HAS_HIDDEN,
             g_param_spec_boolean("has-hidden", NULL, NULL, FALSE, G_PARAM_READABLE));
+
+    g_object_class_install_property(gobject_class, PROP_STATS,
+            g_param_spec_boxed("stats", NULL, NULL, TYPE_SYSTRAY_BOX_STATS,
+            G_PARAM_READABLE));
 }
 
 
@@ -127,13 +231,21 @@ static void
 systray_box_init(SystrayBox *box) {
     gtk_widget_set_has_window(GTK_WIDGET(box), FALSE);
 
-    box->childeren = NULL;
+    box->children = g_array_new(FALSE, TRUE, sizeof(SystrayBoxChild));
+    box->index = g_array_new(FALSE, FALSE, sizeof(SystrayBoxIndexEntry));
+    box->index_rows = g_array_new(FALSE, FALSE, sizeof(SystrayBoxIndexRow));
+    box->index_valid = FALSE;
+    box->freeze_count = 0;
+    box->sort_pending = FALSE;
+    box->resize_pending = FALSE;
     box->size_max = SIZE_MAX_DEFAULT;
     box->size_alloc = SIZE_MAX_DEFAULT;
     box->n_hidden_childeren = 0;
     box->n_visible_children = 0;
     box->horizontal = TRUE;
     box->show_hidden = TRUE;
+    box->requisition_valid = FALSE;
+    memset(&box->stats, 0, sizeof(box->stats));
 }
 
 
@@ -147,6 +259,10 @@ systray_box_get_property(GObject *object, guint prop_id, GValue *value,
             g_value_set_boolean(value, box->n_hidden_childeren > 0);
             break;
 
+        case PROP_STATS:
+            g_value_set_boxed(value, &box->stats);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
             break;
@@ -157,14 +273,21 @@ systray_box_get_property(GObject *object, guint prop_id, GValue *value,
 static void
 systray_box_finalize(GObject *object) {
     SystrayBox *box = SYSTRAY_BOX(object);
+    guint i;
 
     /* check if we're leaking */
-    if (G_UNLIKELY(box->childeren != NULL)) {
-        /* free the child list */
-        g_slist_free(box->childeren);
+    if (G_UNLIKELY(box->children->len > 0)) {
+        /* free the child records */
+        for (i = 0; i < box->children->len; i++) {
+            g_free(g_array_index(box->children, SystrayBoxChild, i).sort_key);
+        }
         g_debug("Not all icons has been removed from the systray.");
     }
 
+    g_array_free(box->children, TRUE);
+    g_array_free(box->index, TRUE);
+    g_array_free(box->index_rows, TRUE);
+
     G_OBJECT_CLASS(systray_box_parent_class)->finalize(object);
 }
 
@@ -206,11 +329,22 @@ systray_box_size_get_max_child_size(SystrayBox *box, gint alloc_size, gint *rows
 
 
 static void
-systray_box_size_request(GtkWidget *widget, GtkRequisition *requisition) {
-    SystrayBox *box = SYSTRAY_BOX(widget);
-    GtkWidget *child;
-    gint border;
-    GtkRequisition child_req;
+systray_box_queue_resize(SystrayBox *box) {
+    /* drop the cached requisition */
+    box->requisition_valid = FALSE;
+
+    if (box->freeze_count > 0) {
+        box->resize_pending = TRUE;
+        return;
+    }
+
+    gtk_widget_queue_resize(GTK_WIDGET(box));
+}
+
+
+static void
+systray_box_size_request_children(SystrayBox *box, GtkRequisition *requisition) {
+    SystrayBoxChild *child;
     gint n_hidden_childeren = 0;
     gint rows;
     gdouble cols;
@@ -218,39 +352,47 @@ systray_box_size_request(GtkWidget *widget, GtkRequisition *requisition) {
     gdouble cells;
     gint min_seq_cells = -1;
     gdouble ratio;
-    GSList *li;
-    gboolean hidden;
+    guint i;
     gint col_px;
     gint row_px;
 
     box->n_visible_children = 0;
+    box->stats.n_size_requests++;
 
     /* get some info about the n_rows we're going to allocate */
     systray_box_size_get_max_child_size(box, box->size_alloc, &rows, &row_size,
                                         NULL);
 
-    for (li = box->childeren, cells = 0.00; li != NULL; li = li->next) {
-        child = GTK_WIDGET(li->data);
-        g_return_if_fail(IS_SYSTRAY_SOCKET(child));
+    for (i = 0, cells = 0.00; i < box->children->len; i++) {
+        child = &g_array_index(box->children, SystrayBoxChild, i);
 
-        gtk_widget_get_preferred_size(child, NULL, &child_req);
+        /* remember the size for the allocation, it only changes when the
+         * child tells us */
+        if (!child->req_valid) {
+            gtk_widget_get_preferred_size(child->widget, NULL, &child->req);
+            child->req_valid = TRUE;
+            box->stats.n_child_requests++;
+        }
+
+        child->ratio = 1.00;
+        if (G_UNLIKELY(child->req.width != child->req.height && child->req.height > 0)) {
+            child->ratio = (gdouble)child->req.width / (gdouble)child->req.height;
+            if (!box->horizontal) child->ratio = 1 / child->ratio;
+        }
 
         /* skip invisible requisitions (see macro) or hidden widgets */
-        if (REQUISITION_IS_INVISIBLE(child_req) ||
-            !gtk_widget_is_visible(child))
+        if (REQUISITION_IS_INVISIBLE(child->req) || !child->visible)
             continue;
 
-        hidden = systray_socket_get_hidden(SYSTRAY_SOCKET(child));
-        if (hidden) n_hidden_childeren++;
+        if (child->hidden) n_hidden_childeren++;
 
         /* if we show hidden icons */
-        if (!hidden || box->show_hidden) {
+        if (!child->hidden || box->show_hidden) {
             /* special handling for non-squared icons. this only works if
              * the icon size ratio is > 1.00, if this is lower then 1.00
              * the icon implementation should respect the tray orientation */
-            if (G_UNLIKELY(child_req.width != child_req.height)) {
-                ratio = (gdouble)child_req.width / (gdouble)child_req.height;
-                if (!box->horizontal) ratio = 1 / ratio;
+            if (G_UNLIKELY(child->ratio != 1.00)) {
+                ratio = child->ratio;
 
                 if (ratio > 1.00) {
                     if (G_UNLIKELY(rows > 1)) {
@@ -309,11 +451,25 @@ systray_box_size_request(GtkWidget *widget, GtkRequisition *requisition) {
         box->n_hidden_childeren = n_hidden_childeren;
         g_object_notify(G_OBJECT(box), "has-hidden");
     }
+}
+
+
+static void
+systray_box_size_request(GtkWidget *widget, GtkRequisition *requisition) {
+    SystrayBox *box = SYSTRAY_BOX(widget);
+    gint border;
+
+    /* gtk asks for the width and the height separately, only walk the
+     * children for the first one */
+    if (!box->requisition_valid) {
+        systray_box_size_request_children(box, &box->requisition);
+        box->requisition_valid = TRUE;
+    }
 
-    /* add border size */
+    /* add border size, on both sides like the allocation subtracts it */
     border = gtk_container_get_border_width(GTK_CONTAINER(widget));
-    requisition->width += border;
-    requisition->height += border;
+    requisition->width = box->requisition.width + 2 * border;
+    requisition->height = box->requisition.height + 2 * border;
 }
 
 
@@ -334,24 +490,214 @@ systray_box_get_preferred_height(GtkWidget *widget, gint *minimal_height, gint *
 }
 
 
+static gboolean
+systray_box_pack_item(SystrayBox *box, SystrayBoxChild *item, SystrayBoxPacker *packer,
+        gint row_size, gboolean place) {
+    gint length, span, offset = 0;
+
+    /* length of the icon along the rows, and the space it takes up there.
+     * with multiple rows wide icons are aligned to whole cells */
+    length = row_size * item->ratio;
+    if (packer->rows > 1 && item->ratio != 1.00) {
+        span = row_size * ceil(item->ratio);
+        offset = (span - length) / 2;
+    } else {
+        span = row_size * item->ratio;
+    }
+
+    /* start a new row if the icon doesn't fit anymore */
+    if (packer->pos + length > packer->pos_end) {
+        packer->pos = packer->pos_start;
+        packer->line += row_size + SPACING;
+
+        /* we overflow the number of rows */
+        if (packer->line > packer->line_end) {
+            return FALSE;
+        }
+    }
+
+    if (place) {
+        if (box->horizontal) {
+            item->alloc.x = packer->pos + offset;
+            item->alloc.y = packer->line;
+            item->alloc.width = length;
+            item->alloc.height = row_size;
+        } else {
+            item->alloc.x = packer->line;
+            item->alloc.y = packer->pos + offset;
+            item->alloc.width = row_size;
+            item->alloc.height = length;
+        }
+    }
+
+    packer->pos += span + SPACING;
+
+    return TRUE;
+}
+
+
+static void
+systray_box_park(SystrayBoxChild *item, gint row_size) {
+    /* position hidden icons offscreen if we don't show hidden icons
+     * or the requested size looks like an invisible icons (see macro).
+     * some implementations (hi nm-applet) start their setup on
+     * a size-changed signal, so make sure this event is triggered
+     * by allocation a normal size instead of 1x1 */
+    item->alloc.x = item->alloc.y = OFFSCREEN;
+    item->alloc.width = item->alloc.height = row_size;
+}
+
+
+static void
+systray_box_overflow(SystrayBoxChild *item, gint row_size) {
+    /* left out of the layout for this allocation */
+    item->offscreen = TRUE;
+    systray_box_park(item, row_size);
+}
+
+
+static gboolean
+systray_box_pack(SystrayBox *box, const SystrayBoxPacker *bounds, gint row_size,
+        gboolean place) {
+    SystrayBoxPacker packer = *bounds;
+    SystrayBoxChild *item, *deferred = NULL;
+    guint i, n_items = box->children->len;
+    gboolean fits = TRUE;
+
+    for (i = 0; i < n_items; i++) {
+        item = &g_array_index(box->children, SystrayBoxChild, i);
+
+        if (!item->visible) continue;
+
+        if (item->offscreen) {
+            if (place) systray_box_park(item, row_size);
+            continue;
+        }
+
+        if (deferred == NULL && item->ratio >= 2 && i + 1 < n_items &&
+            packer.pos + (gint)(row_size * item->ratio) > packer.pos_end) {
+            /* a wide icon doesn't fit, but maybe we still have space for the
+             * next icons, so place it after them at the start of the next row */
+            deferred = item;
+            continue;
+        }
+
+        if (deferred != NULL && fits &&
+            packer.pos + (gint)(row_size * item->ratio) > packer.pos_end) {
+            /* the row is full, now the deferred icon goes first */
+            fits = systray_box_pack_item(box, deferred, &packer, row_size, place);
+            if (!fits) {
+                if (!place) return FALSE;
+                systray_box_overflow(deferred, row_size);
+            }
+            deferred = NULL;
+        }
+
+        if (fits) {
+            fits = systray_box_pack_item(box, item, &packer, row_size, place);
+        }
+        if (!fits) {
+            if (!place) return FALSE;
+
+            /* even the smallest row size overflows. every icon still gets a
+             * fresh allocation, the ones that don't fit go offscreen */
+            systray_box_overflow(item, row_size);
+        }
+    }
+
+    if (deferred != NULL) {
+        if (fits) {
+            fits = systray_box_pack_item(box, deferred, &packer, row_size, place);
+        }
+        if (!fits && place) {
+            systray_box_overflow(deferred, row_size);
+        }
+    }
+
+    return fits;
+}
+
+
+static gint
+systray_box_index_compare(gconstpointer a, gconstpointer b, gpointer user_data) {
+    const GdkRectangle *rect_a = &((const SystrayBoxIndexEntry *)a)->rect;
+    const GdkRectangle *rect_b = &((const SystrayBoxIndexEntry *)b)->rect;
+    gboolean horizontal = GPOINTER_TO_INT(user_data);
+
+    /* by row first, then along the row */
+    if (horizontal) {
+        if (rect_a->y != rect_b->y) return rect_a->y < rect_b->y ? -1 : 1;
+        return rect_a->x < rect_b->x ? -1 : (rect_a->x > rect_b->x ? 1 : 0);
+    } else {
+        if (rect_a->x != rect_b->x) return rect_a->x < rect_b->x ? -1 : 1;
+        return rect_a->y < rect_b->y ? -1 : (rect_a->y > rect_b->y ? 1 : 0);
+    }
+}
+
+
+static void
+systray_box_index_build(SystrayBox *box) {
+    SystrayBoxChild *child;
+    SystrayBoxIndexEntry entry;
+    SystrayBoxIndexEntry *entries;
+    SystrayBoxIndexRow row, *last = NULL;
+    gint line, size;
+    guint i;
+
+    g_array_set_size(box->index, 0);
+    g_array_set_size(box->index_rows, 0);
+
+    for (i = 0; i < box->children->len; i++) {
+        child = &g_array_index(box->children, SystrayBoxChild, i);
+        if (!child->visible || child->offscreen) continue;
+
+        entry.widget = child->widget;
+        entry.rect = child->alloc;
+        g_array_append_val(box->index, entry);
+    }
+
+    /* deferred wide icons are placed out of order */
+    g_array_sort_with_data(box->index, systray_box_index_compare,
+                           GINT_TO_POINTER(box->horizontal));
+
+    entries = (SystrayBoxIndexEntry *)box->index->data;
+    for (i = 0; i < box->index->len; i++) {
+        line = box->horizontal ? entries[i].rect.y : entries[i].rect.x;
+        size = box->horizontal ? entries[i].rect.height : entries[i].rect.width;
+
+        if (last != NULL && last->line == line) {
+            last->size = MAX(last->size, size);
+            last->n++;
+        } else {
+            row.line = line;
+            row.size = size;
+            row.first = i;
+            row.n = 1;
+            g_array_append_val(box->index_rows, row);
+            last = &g_array_index(box->index_rows, SystrayBoxIndexRow,
+                                  box->index_rows->len - 1);
+        }
+    }
+
+    box->index_valid = TRUE;
+}
+
+
 static void
 systray_box_size_allocate(GtkWidget *widget, GtkAllocation *allocation) {
     SystrayBox *box = SYSTRAY_BOX(widget);
-    GtkWidget *child;
+    SystrayBoxChild *child;
+    SystrayBoxPacker packer;
     GtkAllocation child_alloc;
-    GtkRequisition child_req;
+    guint i;
     gint border;
     gint rows;
-    gint row_size;
-    gdouble ratio;
-    gint x, x_start, x_end;
-    gint y, y_start, y_end;
+    gint row_size, lo, hi;
     gint offset;
-    GSList *li;
     gint alloc_size;
-    gint idx;
 
     gtk_widget_set_allocation(widget, allocation);
+    box->stats.n_size_allocates++;
 
     border = gtk_container_get_border_width(GTK_CONTAINER(widget));
 
@@ -364,180 +710,255 @@ systray_box_size_allocate(GtkWidget *widget, GtkAllocation *allocation) {
             rows, row_size, allocation->width, allocation->height,
             (box->horizontal ? "true" : "false"), border);
 
-    /* get allocation bounds */
-    x_start = allocation->x + border;
-    x_end = allocation->x + allocation->width - border;
-
-    y_start = allocation->y + border;
-    y_end = allocation->y + allocation->height - border;
-
-    /* add offset to center the tray contents */
+    /* get allocation bounds along and across the rows, with the offset to
+     * center the tray contents */
+    packer.rows = rows;
     if (box->horizontal) {
-        y_start += offset;
+        packer.pos_start = allocation->x + border;
+        packer.pos_end = allocation->x + allocation->width - border;
+        packer.line_start = allocation->y + border + offset;
+        packer.line_end = allocation->y + allocation->height - border;
     } else {
-        x_start += offset;
+        packer.pos_start = allocation->y + border;
+        packer.pos_end = allocation->y + allocation->height - border;
+        packer.line_start = allocation->x + border + offset;
+        packer.line_end = allocation->x + allocation->width - border;
+    }
+    packer.pos = packer.pos_start;
+    packer.line = packer.line_start;
+
+    /* the sizes are known from the size request, only decide which icons
+     * don't take part in the layout */
+    for (i = 0; i < box->children->len; i++) {
+        child = &g_array_index(box->children, SystrayBoxChild, i);
+        child->offscreen = REQUISITION_IS_INVISIBLE(child->req) ||
+                           (!box->show_hidden && child->hidden);
     }
 
-restart_allocation:
+    /* find the largest row size at which all icons fit. fitting only gets
+     * easier with smaller icons, so a binary search will do */
+    if (!systray_box_pack(box, &packer, row_size, FALSE)) {
+        lo = 1;
+        hi = row_size - 1;
+        row_size = 1;
 
-    x = x_start;
-    y = y_start;
+        while (lo <= hi) {
+            box->stats.n_allocation_restarts++;
 
-    for (li = box->childeren; li != NULL; li = li->next) {
-        child = GTK_WIDGET(li->data);
-        g_return_if_fail(IS_SYSTRAY_SOCKET(child));
+            if (systray_box_pack(box, &packer, (lo + hi) / 2, FALSE)) {
+                row_size = (lo + hi) / 2;
+                lo = row_size + 1;
+            } else {
+                hi = (lo + hi) / 2 - 1;
+            }
+        }
 
-        if (!gtk_widget_is_visible(child)) continue;
+        g_debug("overflow, allocate with row_size=%d", row_size);
+    }
 
-        gtk_widget_get_preferred_size(child, NULL, &child_req);
+    /* place all icons in one pass. if they overflow even at the smallest
+     * row size, the rest are parked offscreen */
+    systray_box_pack(box, &packer, row_size, TRUE);
+
+    for (i = 0; i < box->children->len; i++) {
+        child = &g_array_index(box->children, SystrayBoxChild, i);
+        if (!child->visible) continue;
+
+        /* icons that keep their place and size cost nothing. the size
+         * request is compared too, a socket that asked for a new size
+         * has to tell its plug even if it doesn't get it */
+        gtk_widget_get_allocation(child->widget, &child_alloc);
+        if (child->allocated &&
+            child_alloc.x == child->alloc.x && child_alloc.y == child->alloc.y &&
+            child_alloc.width == child->alloc.width &&
+            child_alloc.height == child->alloc.height &&
+            child->alloc_req.width == child->req.width &&
+            child->alloc_req.height == child->req.height) {
+            box->stats.n_child_allocations_skipped++;
+            continue;
+        }
 
-        if (REQUISITION_IS_INVISIBLE(child_req)
-                || (!box->show_hidden && systray_socket_get_hidden(SYSTRAY_SOCKET(child)))) {
-            /* position hidden icons offscreen if we don't show hidden icons
-             * or the requested size looks like an invisible icons (see macro)
-             */
-            child_alloc.x = child_alloc.y = OFFSCREEN;
+        child->allocated = TRUE;
+        child->alloc_req = child->req;
+        box->stats.n_child_allocations++;
 
-            /* some implementations (hi nm-applet) start their setup on
-             * a size-changed signal, so make sure this event is triggered
-             * by allocation a normal size instead of 1x1 */
-            child_alloc.width = child_alloc.height = row_size;
-        } else {
-            /* special case handling for non-squared icons */
-            if (G_UNLIKELY(child_req.width != child_req.height)) {
-                ratio = (gdouble)child_req.width / (gdouble)child_req.height;
+        g_debug("allocated %s[%p] at (%d,%d;%d,%d)",
+                systray_socket_get_name(SYSTRAY_SOCKET(child->widget)), child->widget,
+                child->alloc.x, child->alloc.y, child->alloc.width, child->alloc.height);
 
-                if (box->horizontal) {
-                    child_alloc.height = row_size;
-                    child_alloc.width = row_size * ratio;
-                    child_alloc.y = child_alloc.x = 0;
+        gtk_widget_size_allocate(child->widget, &child->alloc);
+    }
 
-                    if (rows > 1) {
-                        ratio = ceil(ratio);
-                        child_alloc.x =
-                            ((ratio * row_size) - child_alloc.width) / 2;
-                    }
-                } else {
-                    ratio = 1 / ratio;
+    systray_box_index_build(box);
+}
 
-                    child_alloc.width = row_size;
-                    child_alloc.height = row_size * ratio;
-                    child_alloc.x = child_alloc.y = 0;
 
-                    if (rows > 1) {
-                        ratio = ceil(ratio);
-                        child_alloc.y =
-                            ((ratio * row_size) - child_alloc.height) / 2;
-                    }
-                }
-            } else {
-                /* fix icon to row size */
-                child_alloc.width = row_size;
-                child_alloc.height = row_size;
-                child_alloc.x = 0;
-                child_alloc.y = 0;
+static void
+systray_box_child_clear(SystrayBoxChild *child) {
+    g_free(child->sort_key);
+}
 
-                ratio = 1.00;
-            }
 
-            if ((box->horizontal && x + child_alloc.width > x_end) ||
-                (!box->horizontal && y + child_alloc.height > y_end)) {
-                if (ratio >= 2 && li->next != NULL) {
-                    /* child doesn't fit, but maybe we still have space for the
-                     * next icon, so move the child 1 step forward in the list
-                     * and restart allocating the box */
-                    idx = g_slist_position(box->childeren, li);
-                    box->childeren = g_slist_delete_link(box->childeren, li);
-                    box->childeren =
-                        g_slist_insert(box->childeren, child, idx + 1);
-
-                    goto restart_allocation;
-                }
+static gboolean
+systray_box_child_update(SystrayBoxChild *child) {
+    SystraySocket *socket = SYSTRAY_SOCKET(child->widget);
+    const gchar *name;
+    gchar *sort_key;
+    gboolean hidden, changed;
 
-                if (box->horizontal) {
-                    x = x_start;
-                    y += row_size + SPACING;
+    hidden = systray_socket_get_hidden(socket);
 
-                    if (y > y_end) {
-                        /* we overflow the number of rows, restart
-                         * allocation with 1px smaller icons */
-                        row_size--;
+    /* compare the names in the user's locale once here, and only with
+     * strcmp when sorting */
+    name = systray_socket_get_name(socket);
+    sort_key = name != NULL ? g_utf8_collate_key(name, -1) : NULL;
 
-                        g_debug(
-                            "y overflow (%d > %d), restart with row_size=%d", y,
-                            y_end, row_size);
+    changed = child->hidden != hidden || g_strcmp0(child->sort_key, sort_key) != 0;
 
-                        goto restart_allocation;
-                    }
-                } else {
-                    y = y_start;
-                    x += row_size + SPACING;
+    child->hidden = hidden;
+    g_free(child->sort_key);
+    child->sort_key = sort_key;
 
-                    if (x > x_end) {
-                        /* we overflow the number of rows, restart
-                         * allocation with 1px smaller icons */
-                        row_size--;
+    return changed;
+}
 
-                        g_debug(
-                            "x overflow (%d > %d), restart with row_size=%d", x,
-                            x_end, row_size);
 
-                        goto restart_allocation;
-                    }
-                }
-            }
+static void
+systray_box_child_set_index(SystrayBox *box, guint idx) {
+    /* stored plus one, no data means the widget is not in a box */
+    g_object_set_qdata(
+        G_OBJECT(g_array_index(box->children, SystrayBoxChild, idx).widget),
+        systray_box_index_quark, GUINT_TO_POINTER(idx + 1));
+}
 
-            child_alloc.x += x;
-            child_alloc.y += y;
 
-            if (box->horizontal) {
-                x += row_size * ratio + SPACING;
-            } else {
-                y += row_size * ratio + SPACING;
-            }
+static void
+systray_box_reindex(SystrayBox *box, guint first, guint last) {
+    guint i;
+
+    /* the records from first to last moved */
+    for (i = first; i <= last && i < box->children->len; i++) {
+        systray_box_child_set_index(box, i);
+    }
+}
+
+
+static guint
+systray_box_insert(SystrayBox *box, const SystrayBoxChild *record) {
+    guint lo, hi, mid;
+
+    /* insert after all children sorting before or equal to it */
+    lo = 0;
+    hi = box->children->len;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (systray_box_compare_function(
+                &g_array_index(box->children, SystrayBoxChild, mid), record) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    g_array_insert_vals(box->children, lo, record, 1);
+
+    return lo;
+}
 
-        g_debug("allocated %s[%p] at (%d,%d;%d,%d)",
-                systray_socket_get_name(SYSTRAY_SOCKET(child)), child, child_alloc.x,
-                child_alloc.y, child_alloc.width, child_alloc.height);
 
-        gtk_widget_size_allocate(child, &child_alloc);
+static void
+systray_box_sort(SystrayBox *box) {
+    if (!box->sort_pending) {
+        return;
     }
+
+    g_array_sort(box->children, systray_box_compare_function);
+    systray_box_reindex(box, 0, G_MAXUINT);
+
+    box->sort_pending = FALSE;
+}
+
+
+static gint
+systray_box_find(SystrayBox *box, GtkWidget *widget) {
+    guint idx;
+
+    idx = GPOINTER_TO_UINT(g_object_get_qdata(G_OBJECT(widget), systray_box_index_quark));
+    if (idx == 0 || idx > box->children->len ||
+        g_array_index(box->children, SystrayBoxChild, idx - 1).widget != widget) {
+        return -1;
+    }
+
+    return idx - 1;
+}
+
+
+static void
+systray_box_remove_index(SystrayBox *box, guint idx) {
+    g_object_set_qdata(
+        G_OBJECT(g_array_index(box->children, SystrayBoxChild, idx).widget),
+        systray_box_index_quark, NULL);
+    systray_box_child_clear(&g_array_index(box->children, SystrayBoxChild, idx));
+
+    /* the records after it stay sorted, but their indices change */
+    g_array_remove_index(box->children, idx);
+    systray_box_reindex(box, idx, G_MAXUINT);
 }
 
 
 static void
 systray_box_add(GtkContainer *container, GtkWidget *child) {
     SystrayBox *box = SYSTRAY_BOX(container);
+    SystrayBoxChild record;
 
     g_return_if_fail(IS_SYSTRAY_BOX(box));
-    g_return_if_fail(GTK_IS_WIDGET(child));
+    g_return_if_fail(IS_SYSTRAY_SOCKET(child));
     g_return_if_fail(gtk_widget_get_parent(child) == NULL);
 
-    box->childeren = g_slist_insert_sorted(box->childeren, child, systray_box_compare_function);
+    memset(&record, 0, sizeof(record));
+    record.widget = child;
+    record.ratio = 1.00;
+    record.visible = gtk_widget_get_visible(child);
+    systray_box_child_update(&record);
+    if (box->freeze_count > 0) {
+        g_array_append_val(box->children, record);
+        systray_box_child_set_index(box, box->children->len - 1);
+        box->sort_pending = TRUE;
+    } else {
+        systray_box_reindex(box, systray_box_insert(box, &record), G_MAXUINT);
+    }
 
     gtk_widget_set_parent(child, GTK_WIDGET(box));
+    g_signal_connect(G_OBJECT(child), "notify::visible",
+                     G_CALLBACK(systray_box_child_visible_changed), box);
+    g_signal_connect(G_OBJECT(child), "request-changed",
+                     G_CALLBACK(systray_box_child_request_changed), box);
 
-    gtk_widget_queue_resize(GTK_WIDGET(container));
+    systray_box_queue_resize(box);
 }
 
 
 static void
 systray_box_remove(GtkContainer *container, GtkWidget *child) {
     SystrayBox *box = SYSTRAY_BOX(container);
-    GSList *li;
+    gint idx;
 
     /* search the child */
-    li = g_slist_find(box->childeren, child);
-    if (G_LIKELY(li != NULL)) {
-        g_assert(GTK_WIDGET(li->data) == child);
+    idx = systray_box_find(box, child);
+    if (G_LIKELY(idx != -1)) {
+        systray_box_remove_index(box, idx);
+
+        /* the index must not point to the widget anymore */
+        box->index_valid = FALSE;
 
         /* unparent widget */
-        box->childeren = g_slist_remove_link(box->childeren, li);
+        g_signal_handlers_disconnect_by_func(G_OBJECT(child),
+                                             systray_box_child_visible_changed, box);
+        g_signal_handlers_disconnect_by_func(G_OBJECT(child),
+                                             systray_box_child_request_changed, box);
         gtk_widget_unparent(child);
 
         /* resize, so we update has-hidden */
-        gtk_widget_queue_resize(GTK_WIDGET(container));
+        systray_box_queue_resize(box);
     }
 }
 
@@ -546,12 +967,50 @@ static void
 systray_box_forall(GtkContainer *container, gboolean include_internals, GtkCallback callback,
         gpointer callback_data) {
     SystrayBox *box = SYSTRAY_BOX(container);
-    GSList *li, *lnext;
+    GtkWidget *child;
+    guint i;
+
+    /* run callback for all childeren, the callback might remove the child */
+    for (i = 0; i < box->children->len;) {
+        child = g_array_index(box->children, SystrayBoxChild, i).widget;
+        (*callback)(child, callback_data);
+
+        if (i < box->children->len &&
+            g_array_index(box->children, SystrayBoxChild, i).widget == child) {
+            i++;
+        }
+    }
+}
+
+
+static void
+systray_box_child_visible_changed(GtkWidget *child, GParamSpec *pspec, SystrayBox *box) {
+    gint idx;
+
+    /* invisible children don't take space */
+    idx = systray_box_find(box, child);
+    if (G_LIKELY(idx != -1)) {
+        g_array_index(box->children, SystrayBoxChild, idx).visible =
+            gtk_widget_get_visible(child);
+
+        /* gtk resets the allocation of hidden widgets */
+        g_array_index(box->children, SystrayBoxChild, idx).allocated = FALSE;
+        g_array_index(box->children, SystrayBoxChild, idx).req_valid = FALSE;
+        box->index_valid = FALSE;
+        systray_box_queue_resize(box);
+    }
+}
+
+
+static void
+systray_box_child_request_changed(GtkWidget *child, SystrayBox *box) {
+    gint idx;
 
-    /* run callback for all childeren */
-    for (li = box->childeren; li != NULL; li = lnext) {
-        lnext = li->next;
-        (*callback)(GTK_WIDGET(li->data), callback_data);
+    /* the cached requisitions don't know the new size yet */
+    idx = systray_box_find(box, child);
+    if (G_LIKELY(idx != -1)) {
+        g_array_index(box->children, SystrayBoxChild, idx).req_valid = FALSE;
+        systray_box_queue_resize(box);
     }
 }
 
@@ -564,26 +1023,13 @@ systray_box_child_type(GtkContainer *container) {
 
 static gint
 systray_box_compare_function(gconstpointer a, gconstpointer b) {
-    const gchar *name_a, *name_b;
-    gboolean hidden_a, hidden_b;
+    const SystrayBoxChild *child_a = a, *child_b = b;
 
     /* sort hidden icons before visible ones */
-    hidden_a = systray_socket_get_hidden(SYSTRAY_SOCKET(a));
-    hidden_b = systray_socket_get_hidden(SYSTRAY_SOCKET(b));
-    if (hidden_a != hidden_b) return hidden_a ? 1 : -1;
-
-    /* sort icons by name */
-    name_a = systray_socket_get_name(SYSTRAY_SOCKET(a));
-    name_b = systray_socket_get_name(SYSTRAY_SOCKET(b));
+    if (child_a->hidden != child_b->hidden) return child_a->hidden ? 1 : -1;
 
-#if GLIB_CHECK_VERSION(2, 16, 0)
-    return g_strcmp0(name_a, name_b);
-#else
-    if (name_a == NULL) return -(name_a != name_b);
-    if (name_b == NULL) return name_a != name_b;
-
-    return strcmp(name_a, name_b);
-#endif
+    /* sort icons by name, the keys are already collated */
+    return g_strcmp0(child_a->sort_key, child_b->sort_key);
 }
 
 
@@ -603,13 +1049,21 @@ systray_box_set_orientation(SystrayBox *box, GtkOrientation orientation) {
     if (G_LIKELY(box->horizontal != horizontal)) {
         box->horizontal = horizontal;
 
-        if (box->childeren != NULL) {
-            gtk_widget_queue_resize(GTK_WIDGET(box));
+        if (box->children->len > 0) {
+            systray_box_queue_resize(box);
         }
     }
 }
 
 
+GtkOrientation
+systray_box_get_orientation(SystrayBox *box) {
+    g_return_val_if_fail(IS_SYSTRAY_BOX(box), GTK_ORIENTATION_HORIZONTAL);
+
+    return box->horizontal ? GTK_ORIENTATION_HORIZONTAL : GTK_ORIENTATION_VERTICAL;
+}
+
+
 void
 systray_box_set_size_max(SystrayBox *box, gint size_max) {
     g_return_if_fail(IS_SYSTRAY_BOX(box));
@@ -619,8 +1073,8 @@ systray_box_set_size_max(SystrayBox *box, gint size_max) {
     if (G_LIKELY(size_max != box->size_max)) {
         box->size_max = size_max;
 
-        if (box->childeren != NULL) {
-            gtk_widget_queue_resize(GTK_WIDGET(box));
+        if (box->children->len > 0) {
+            systray_box_queue_resize(box);
         }
     }
 }
@@ -641,7 +1095,7 @@ systray_box_set_size_alloc(SystrayBox *box, gint size_alloc) {
     if (G_LIKELY(size_alloc != box->size_alloc)) {
         box->size_alloc = size_alloc;
 
-        if (box->childeren != NULL) gtk_widget_queue_resize(GTK_WIDGET(box));
+        if (box->children->len > 0) systray_box_queue_resize(box);
     }
 }
 
@@ -653,8 +1107,8 @@ systray_box_set_show_hidden(SystrayBox *box, gboolean show_hidden) {
     if (box->show_hidden != show_hidden) {
         box->show_hidden = show_hidden;
 
-        if (box->childeren != NULL) {
-            gtk_widget_queue_resize(GTK_WIDGET(box));
+        if (box->children->len > 0) {
+            systray_box_queue_resize(box);
         }
     }
 }
@@ -670,11 +1124,221 @@ systray_box_get_show_hidden(SystrayBox *box) {
 
 void
 systray_box_update(SystrayBox *box) {
+    guint i;
+
     g_return_if_fail(IS_SYSTRAY_BOX(box));
 
-    box->childeren = g_slist_sort(box->childeren, systray_box_compare_function);
+    /* pick up hidden and name changes of the icons */
+    for (i = 0; i < box->children->len; i++) {
+        systray_box_child_update(&g_array_index(box->children, SystrayBoxChild, i));
+    }
+
+    box->sort_pending = TRUE;
+    systray_box_sort(box);
 
     /* update the box, so we update the has-hidden property */
-    gtk_widget_queue_resize(GTK_WIDGET(box));
+    systray_box_queue_resize(box);
+}
+
+
+void
+systray_box_update_child(SystrayBox *box, GtkWidget *child) {
+    SystrayBoxChild record;
+    guint new_idx;
+    gint idx;
+
+    g_return_if_fail(IS_SYSTRAY_BOX(box));
+    g_return_if_fail(IS_SYSTRAY_SOCKET(child));
+
+    idx = systray_box_find(box, child);
+    g_return_if_fail(idx != -1);
+
+    if (!systray_box_child_update(&g_array_index(box->children, SystrayBoxChild, idx))) {
+        return;
+    }
+
+    if (box->sort_pending) {
+        /* everything is sorted on thaw anyway */
+        systray_box_queue_resize(box);
+        return;
+    }
+
+    /* only this icon moves, the others stay sorted */
+    record = g_array_index(box->children, SystrayBoxChild, idx);
+    g_array_remove_index(box->children, idx);
+    new_idx = systray_box_insert(box, &record);
+    systray_box_reindex(box, MIN((guint)idx, new_idx), MAX((guint)idx, new_idx));
+
+    /* update the box, so we update the has-hidden property */
+    systray_box_queue_resize(box);
+}
+
+
+void
+systray_box_freeze(SystrayBox *box) {
+    g_return_if_fail(IS_SYSTRAY_BOX(box));
+
+    box->freeze_count++;
+}
+
+
+void
+systray_box_thaw(SystrayBox *box) {
+    g_return_if_fail(IS_SYSTRAY_BOX(box));
+    g_return_if_fail(box->freeze_count > 0);
+
+    if (--box->freeze_count > 0) {
+        return;
+    }
+
+    systray_box_sort(box);
+
+    if (box->resize_pending) {
+        box->resize_pending = FALSE;
+        systray_box_queue_resize(box);
+    }
+}
+
+
+void
+systray_box_remove_children(SystrayBox *box, GPtrArray *children) {
+    GHashTable *remove;
+    GPtrArray *removed;
+    SystrayBoxChild *child;
+    guint i, n;
+
+    g_return_if_fail(IS_SYSTRAY_BOX(box));
+    g_return_if_fail(children != NULL);
+
+    if (children->len == 0) {
+        return;
+    }
+
+    remove = g_hash_table_new(NULL, NULL);
+    for (i = 0; i < children->len; i++) {
+        g_hash_table_add(remove, g_ptr_array_index(children, i));
+    }
+
+    /* compact the remaining records in a single pass */
+    removed = g_ptr_array_sized_new(children->len);
+    for (i = 0, n = 0; i < box->children->len; i++) {
+        child = &g_array_index(box->children, SystrayBoxChild, i);
+        if (g_hash_table_contains(remove, child->widget)) {
+            g_ptr_array_add(removed, child->widget);
+            g_object_set_qdata(G_OBJECT(child->widget), systray_box_index_quark, NULL);
+            systray_box_child_clear(child);
+        } else {
+            if (n != i) {
+                g_array_index(box->children, SystrayBoxChild, n) = *child;
+                systray_box_child_set_index(box, n);
+            }
+            n++;
+        }
+    }
+    g_array_set_size(box->children, n);
+    box->index_valid = FALSE;
+
+    /* unparent only after the records are consistent again */
+    for (i = 0; i < removed->len; i++) {
+        g_signal_handlers_disconnect_by_func(G_OBJECT(g_ptr_array_index(removed, i)),
+                                             systray_box_child_visible_changed, box);
+        g_signal_handlers_disconnect_by_func(G_OBJECT(g_ptr_array_index(removed, i)),
+                                             systray_box_child_request_changed, box);
+        gtk_widget_unparent(GTK_WIDGET(g_ptr_array_index(removed, i)));
+    }
+
+    g_ptr_array_unref(removed);
+    g_hash_table_destroy(remove);
+
+    systray_box_queue_resize(box);
+}
+
+
+void
+systray_box_foreach_in_rect(SystrayBox *box, const GdkRectangle *rect, GtkCallback callback,
+        gpointer callback_data) {
+    SystrayBoxIndexRow *rows, *row;
+    SystrayBoxIndexEntry *entries;
+    SystrayBoxChild *child;
+    gint line_start, line_end, pos_start, pos_end;
+    guint lo, hi, mid, i, j;
+
+    g_return_if_fail(IS_SYSTRAY_BOX(box));
+    g_return_if_fail(rect != NULL);
+    g_return_if_fail(callback != NULL);
+
+    if (G_UNLIKELY(!box->index_valid)) {
+        /* not allocated since the icons changed, check them all */
+        for (i = 0; i < box->children->len; i++) {
+            child = &g_array_index(box->children, SystrayBoxChild, i);
+            if (child->visible && !child->offscreen &&
+                gdk_rectangle_intersect(&child->alloc, rect, NULL)) {
+                (*callback)(child->widget, callback_data);
+            }
+        }
+        return;
+    }
+
+    if (box->horizontal) {
+        line_start = rect->y;
+        line_end = rect->y + rect->height;
+        pos_start = rect->x;
+        pos_end = rect->x + rect->width;
+    } else {
+        line_start = rect->x;
+        line_end = rect->x + rect->width;
+        pos_start = rect->y;
+        pos_end = rect->y + rect->height;
+    }
+
+    rows = (SystrayBoxIndexRow *)box->index_rows->data;
+    entries = (SystrayBoxIndexEntry *)box->index->data;
+
+    /* first row reaching into the rectangle */
+    lo = 0;
+    hi = box->index_rows->len;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (rows[mid].line + rows[mid].size <= line_start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (i = lo; i < box->index_rows->len && rows[i].line < line_end; i++) {
+        row = &rows[i];
+
+        /* first icon of the row reaching into the rectangle. icons in a
+         * row don't overlap, so their ends are sorted too */
+        lo = row->first;
+        hi = row->first + row->n;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if ((box->horizontal ? entries[mid].rect.x + entries[mid].rect.width
+                                 : entries[mid].rect.y + entries[mid].rect.height) <= pos_start) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        for (j = lo; j < row->first + row->n &&
+                     (box->horizontal ? entries[j].rect.x : entries[j].rect.y) < pos_end;
+             j++) {
+            if (gdk_rectangle_intersect(&entries[j].rect, rect, NULL)) {
+                (*callback)(entries[j].widget, callback_data);
+            }
+        }
+    }
+}
+
+
+void
+systray_box_get_stats(SystrayBox *box, SystrayBoxStats *stats) {
+    g_return_if_fail(IS_SYSTRAY_BOX(box));
+    g_return_if_fail(stats != NULL);
+
+    *stats = box->stats;
 }
 
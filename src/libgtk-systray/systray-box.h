@@ -21,6 +21,7 @@
 
 typedef struct _SystrayBoxClass SystrayBoxClass;
 typedef struct _SystrayBox SystrayBox;
+typedef struct _SystrayBoxStats SystrayBoxStats;
 
 /* keep those in sync with the glade file too! */
 #define SIZE_MAX_MIN (12)
@@ -39,12 +40,35 @@ typedef struct _SystrayBox SystrayBox;
 #define SYSTRAY_BOX_GET_CLASS(obj) \
     (G_TYPE_INSTANCE_GET_CLASS((obj), TYPE_SYSTRAY_BOX, SystrayBoxClass))
 
+#define TYPE_SYSTRAY_BOX_STATS (systray_box_stats_get_type())
+
+/* counters of the box since it was created */
+struct _SystrayBoxStats {
+    guint64 n_size_requests;
+    guint64 n_size_allocates;
+
+    /* icons asked for their size, the others kept their cached size */
+    guint64 n_child_requests;
+
+    /* passes of the allocation loop that had to start over */
+    guint64 n_allocation_restarts;
+
+    /* icons allocated, and icons left alone because their geometry and
+     * size request did not change */
+    guint64 n_child_allocations;
+    guint64 n_child_allocations_skipped;
+};
+
 GType systray_box_get_type(void) G_GNUC_CONST;
 
+GType systray_box_stats_get_type(void) G_GNUC_CONST;
+
 GtkWidget *systray_box_new(void) G_GNUC_MALLOC;
 
 void systray_box_set_orientation(SystrayBox *box, GtkOrientation orientation);
 
+GtkOrientation systray_box_get_orientation(SystrayBox *box);
+
 void systray_box_set_size_max(SystrayBox *box, gint size_max);
 
 gint systray_box_get_size_max(SystrayBox *box);
@@ -57,4 +81,17 @@ gboolean systray_box_get_show_hidden(SystrayBox *box);
 
 void systray_box_update(SystrayBox *box);
 
+void systray_box_update_child(SystrayBox *box, GtkWidget *child);
+
+void systray_box_freeze(SystrayBox *box);
+
+void systray_box_thaw(SystrayBox *box);
+
+void systray_box_remove_children(SystrayBox *box, GPtrArray *children);
+
+void systray_box_foreach_in_rect(SystrayBox *box, const GdkRectangle *rect,
+                                 GtkCallback callback, gpointer callback_data);
+
+void systray_box_get_stats(SystrayBox *box, SystrayBoxStats *stats);
+
 #endif /* !__SYSTRAY_BOX_H__ */
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+
+#include "systray-cache.h"
+
+
+#define SYSTRAY_CACHE_MAGIC (0x43545347)
+#define SYSTRAY_CACHE_VERSION (1)
+
+/* larger images are not icons, and not trusted */
+#define SYSTRAY_CACHE_SIZE_MAX (1024)
+
+
+typedef struct _SystrayCacheHeader SystrayCacheHeader;
+typedef struct _SystrayCacheRecord SystrayCacheRecord;
+typedef struct _SystrayCacheEntry SystrayCacheEntry;
+
+
+/* the file holds the header, the record table, the keys and the pixel
+ * rows, in native byte order. the pixels are premultiplied ARGB32 at 4 byte
+ * aligned offsets, so the surfaces of a loaded cache point into the mapped
+ * file instead of copies */
+struct _SystrayCacheHeader {
+    guint32 magic;
+    guint32 version;
+    guint32 n_records;
+    guint32 reserved;
+};
+
+
+struct _SystrayCacheRecord {
+    /* seconds since the epoch */
+    gint64 last_seen;
+
+    /* offsets from the start of the file */
+    guint32 key_offset;
+    guint32 key_length;
+    guint32 data_offset;
+
+    guint32 width;
+    guint32 height;
+    guint32 stride;
+};
+
+
+struct _SystrayCacheEntry {
+    cairo_surface_t *surface;
+    gint64 last_seen;
+};
+
+
+struct _SystrayCache {
+    gchar *filename;
+
+    /* key to SystrayCacheEntry */
+    GHashTable *entries;
+};
+
+
+static const cairo_user_data_key_t systray_cache_mapping_key;
+
+
+static void
+systray_cache_entry_free(gpointer data) {
+    SystrayCacheEntry *entry = data;
+
+    cairo_surface_destroy(entry->surface);
+    g_slice_free(SystrayCacheEntry, entry);
+}
+
+
+static void
+systray_cache_insert(SystrayCache *cache, gchar *key, cairo_surface_t *surface,
+                     gint64 last_seen) {
+    SystrayCacheEntry *entry;
+
+    entry = g_slice_new(SystrayCacheEntry);
+    entry->surface = surface;
+    entry->last_seen = last_seen;
+    g_hash_table_replace(cache->entries, key, entry);
+}
+
+
+gchar *
+systray_cache_get_filename(GdkScreen *screen) {
+    gchar *name, *filename;
+
+    g_return_val_if_fail(GDK_IS_SCREEN(screen), NULL);
+
+    name = g_strdup_printf("icons-%d.cache", gdk_screen_get_number(screen));
+    filename = g_build_filename(g_get_user_cache_dir(), "gtk-systray", name, NULL);
+    g_free(name);
+
+    return filename;
+}
+
+
+static gboolean
+systray_cache_record_valid(const SystrayCacheRecord *record, gsize length) {
+    /* everything is checked against the file, it might be truncated or
+     * written by something else */
+    return (guint64)record->key_offset + record->key_length <= length &&
+           record->width > 0 && record->width <= SYSTRAY_CACHE_SIZE_MAX &&
+           record->height > 0 && record->height <= SYSTRAY_CACHE_SIZE_MAX &&
+           record->stride ==
+               (guint32)cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32,
+                                                      record->width) &&
+           record->data_offset % 4 == 0 &&
+           (guint64)record->data_offset + (guint64)record->height * record->stride <=
+               length;
+}
+
+
+SystrayCache *
+systray_cache_load(const gchar *filename, gint64 max_age) {
+    const SystrayCacheHeader *header;
+    const SystrayCacheRecord *records;
+    SystrayCache *cache;
+    cairo_surface_t *surface;
+    GMappedFile *file;
+    gchar *contents;
+    gsize length;
+    gint64 now;
+    guint i;
+
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    cache = g_slice_new(SystrayCache);
+    cache->filename = g_strdup(filename);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           systray_cache_entry_free);
+
+    /* no cache yet, or not readable */
+    file = g_mapped_file_new(filename, FALSE, NULL);
+    if (file == NULL) {
+        return cache;
+    }
+
+    contents = g_mapped_file_get_contents(file);
+    length = g_mapped_file_get_length(file);
+    header = (const SystrayCacheHeader *)contents;
+    if (length < sizeof(SystrayCacheHeader) || header->magic != SYSTRAY_CACHE_MAGIC ||
+        header->version != SYSTRAY_CACHE_VERSION ||
+        header->n_records >
+            (length - sizeof(SystrayCacheHeader)) / sizeof(SystrayCacheRecord)) {
+        g_warning("Ignoring the invalid icon cache %s", filename);
+        g_mapped_file_unref(file);
+        return cache;
+    }
+
+    now = g_get_real_time() / G_USEC_PER_SEC;
+    records = (const SystrayCacheRecord *)(contents + sizeof(SystrayCacheHeader));
+    for (i = 0; i < header->n_records; i++) {
+        if (!systray_cache_record_valid(&records[i], length)) {
+            continue;
+        }
+
+        /* icons of applications not seen for a while are dropped */
+        if (max_age > 0 && now - records[i].last_seen > max_age) {
+            continue;
+        }
+
+        /* the mapping is read only, the surfaces are only painted from */
+        surface = cairo_image_surface_create_for_data(
+            (guchar *)contents + records[i].data_offset, CAIRO_FORMAT_ARGB32,
+            records[i].width, records[i].height, records[i].stride);
+        cairo_surface_set_user_data(surface, &systray_cache_mapping_key,
+                                    g_mapped_file_ref(file),
+                                    (cairo_destroy_func_t)g_mapped_file_unref);
+
+        systray_cache_insert(cache,
+                             g_strndup(contents + records[i].key_offset,
+                                       records[i].key_length),
+                             surface, records[i].last_seen);
+    }
+
+    g_mapped_file_unref(file);
+
+    return cache;
+}
+
+
+void
+systray_cache_free(SystrayCache *cache) {
+    g_return_if_fail(cache != NULL);
+
+    g_hash_table_destroy(cache->entries);
+    g_free(cache->filename);
+    g_slice_free(SystrayCache, cache);
+}
+
+
+cairo_surface_t *
+systray_cache_lookup(SystrayCache *cache, const gchar *key) {
+    SystrayCacheEntry *entry;
+
+    g_return_val_if_fail(cache != NULL, NULL);
+
+    entry = key != NULL ? g_hash_table_lookup(cache->entries, key) : NULL;
+
+    return entry != NULL ? entry->surface : NULL;
+}
+
+
+void
+systray_cache_foreach(SystrayCache *cache, SystrayCacheFunc func, gpointer user_data) {
+    SystrayCacheEntry *entry;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_return_if_fail(cache != NULL);
+    g_return_if_fail(func != NULL);
+
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        entry = value;
+        func(key, entry->surface, user_data);
+    }
+}
+
+
+void
+systray_cache_set(SystrayCache *cache, const gchar *key, cairo_surface_t *surface) {
+    g_return_if_fail(cache != NULL);
+    g_return_if_fail(key != NULL && key[0] != '\0');
+    g_return_if_fail(cairo_image_surface_get_format(surface) == CAIRO_FORMAT_ARGB32);
+
+    /* it would not be loaded again anyway */
+    if (cairo_image_surface_get_width(surface) < 1 ||
+        cairo_image_surface_get_width(surface) > SYSTRAY_CACHE_SIZE_MAX ||
+        cairo_image_surface_get_height(surface) < 1 ||
+        cairo_image_surface_get_height(surface) > SYSTRAY_CACHE_SIZE_MAX) {
+        return;
+    }
+
+    systray_cache_insert(cache, g_strdup(key), cairo_surface_reference(surface),
+                         g_get_real_time() / G_USEC_PER_SEC);
+}
+
+
+gboolean
+systray_cache_save(SystrayCache *cache, GError **error) {
+    SystrayCacheHeader *header;
+    SystrayCacheRecord *record;
+    SystrayCacheEntry *entry;
+    GHashTableIter iter;
+    gpointer key, value;
+    const guchar *src;
+    gchar *contents, *dirname;
+    gsize length, key_offset, data_offset;
+    guint i, n, y, width, height, stride;
+    gboolean succeed;
+
+    g_return_val_if_fail(cache != NULL, FALSE);
+    g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+    /* lay out the file: records, then keys, then pixels */
+    n = g_hash_table_size(cache->entries);
+    key_offset = sizeof(SystrayCacheHeader) + n * sizeof(SystrayCacheRecord);
+    data_offset = key_offset;
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        data_offset += strlen(key);
+    }
+    data_offset = (data_offset + 3) & ~(gsize)3;
+    length = data_offset;
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        entry = value;
+        length += cairo_image_surface_get_height(entry->surface) *
+                  cairo_format_stride_for_width(
+                      CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(entry->surface));
+    }
+
+    contents = g_malloc0(length);
+    header = (SystrayCacheHeader *)contents;
+    header->magic = SYSTRAY_CACHE_MAGIC;
+    header->version = SYSTRAY_CACHE_VERSION;
+    header->n_records = n;
+
+    i = 0;
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        entry = value;
+        width = cairo_image_surface_get_width(entry->surface);
+        height = cairo_image_surface_get_height(entry->surface);
+        stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+
+        record = (SystrayCacheRecord *)(contents + sizeof(SystrayCacheHeader)) + i++;
+        record->last_seen = entry->last_seen;
+        record->key_offset = key_offset;
+        record->key_length = strlen(key);
+        record->data_offset = data_offset;
+        record->width = width;
+        record->height = height;
+        record->stride = stride;
+
+        memcpy(contents + key_offset, key, record->key_length);
+        key_offset += record->key_length;
+
+        cairo_surface_flush(entry->surface);
+        src = cairo_image_surface_get_data(entry->surface);
+        for (y = 0; y < height; y++) {
+            memcpy(contents + data_offset + y * stride,
+                   src + y * cairo_image_surface_get_stride(entry->surface), width * 4);
+        }
+        data_offset += height * stride;
+    }
+
+    /* the file is replaced, not rewritten, so surfaces pointing into the
+     * mapping of the previous one stay valid */
+    dirname = g_path_get_dirname(cache->filename);
+    g_mkdir_with_parents(dirname, 0700);
+    g_free(dirname);
+
+    succeed = g_file_set_contents(cache->filename, contents, length, error);
+    g_free(contents);
+
+    return succeed;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014-2015 Fabian Knorr
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SYSTRAY_CACHE_H__
+#define __SYSTRAY_CACHE_H__
+
+#include <gtk/gtk.h>
+
+typedef struct _SystrayCache SystrayCache;
+
+/* called for every entry, in no particular order */
+typedef void (*SystrayCacheFunc)(const gchar *key, cairo_surface_t *surface,
+                                 gpointer user_data);
+
+gchar *systray_cache_get_filename(GdkScreen *screen) G_GNUC_MALLOC;
+
+SystrayCache *systray_cache_load(const gchar *filename, gint64 max_age) G_GNUC_MALLOC;
+
+void systray_cache_free(SystrayCache *cache);
+
+cairo_surface_t *systray_cache_lookup(SystrayCache *cache, const gchar *key);
+
+void systray_cache_foreach(SystrayCache *cache, SystrayCacheFunc func,
+                           gpointer user_data);
+
+void systray_cache_set(SystrayCache *cache, const gchar *key, cairo_surface_t *surface);
+
+gboolean systray_cache_save(SystrayCache *cache, GError **error);
+
+#endif /* !__SYSTRAY_CACHE_H__ */
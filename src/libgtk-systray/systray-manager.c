@@ -24,12 +24,16 @@
 
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
 
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
 #include <gtk/gtkx.h>
 
+#include "systray-async.h"
+#include "systray-atoms.h"
 #include "systray-manager.h"
 #include "systray-marshal.h"
 #include "systray-socket.h"
@@ -41,6 +45,24 @@
 #define SYSTRAY_MANAGER_ORIENTATION_HORIZONTAL 0
 #define SYSTRAY_MANAGER_ORIENTATION_VERTICAL 1
 
+/* memory budgets for partially received messages, in bytes */
+#define SYSTRAY_MESSAGE_CLIENT_BUDGET (16 * 1024)
+#define SYSTRAY_MESSAGE_GLOBAL_BUDGET (256 * 1024)
+
+/* seconds after which an incomplete message is dropped */
+#define SYSTRAY_MESSAGE_TIMEOUT (30)
+
+/* microseconds of socket creation per batch, half a frame at 60 Hz, and
+ * the guess for the cost of a socket before one has been measured */
+#define SYSTRAY_DOCK_BUDGET_DEFAULT (8000)
+#define SYSTRAY_DOCK_COST_INITIAL (1000)
+
+
+static void systray_manager_set_property(GObject *object, guint prop_id,
+        const GValue *value, GParamSpec *pspec);
+
+static void systray_manager_get_property(GObject *object, guint prop_id, GValue *value,
+        GParamSpec *pspec);
 
 static void systray_manager_finalize(GObject *object);
 
@@ -49,11 +71,14 @@ static void systray_manager_remove_socket(gpointer key, gpointer value, gpointer
 static GdkFilterReturn systray_manager_window_filter(GdkXEvent *xev, GdkEvent *event,
         gpointer user_data);
 
-static GdkFilterReturn systray_manager_handle_client_message_opcode(
-        GdkXEvent *xevent, GdkEvent *event, gpointer user_data);
+static GdkFilterReturn systray_manager_client_message_filter(GdkXEvent *xev,
+        GdkEvent *event, gpointer user_data);
 
-static GdkFilterReturn systray_manager_handle_client_message_message_data(
-        GdkXEvent *xevent, GdkEvent *event, gpointer user_data);
+static gboolean systray_manager_handle_client_message_opcode(SystrayManager *manager,
+        XClientMessageEvent *xevent);
+
+static gboolean systray_manager_handle_client_message_message_data(SystrayManager *manager,
+        XClientMessageEvent *xevent);
 
 static void systray_manager_handle_begin_message(SystrayManager *manager,
         XClientMessageEvent *xevent);
@@ -66,17 +91,34 @@ static void systray_manager_handle_dock_request(SystrayManager *manager,
 
 static gboolean systray_manager_handle_undock_request(GtkSocket *socket, gpointer user_data);
 
-static void systray_manager_set_visual(SystrayManager *manager);
+static void systray_manager_dock_remove_all(SystrayManager *manager);
 
-static void systray_manager_message_free(SystrayMessage *message);
+static void systray_manager_set_visual(SystrayManager *manager);
 
-static void systray_manager_message_remove_from_list(SystrayManager *manager,
+static SystrayMessage *systray_manager_message_new(SystrayManager *manager,
         XClientMessageEvent *xevent);
 
+static void systray_manager_message_free(SystrayManager *manager, SystrayMessage *message);
+
+static void systray_manager_message_remove(SystrayManager *manager, Window window);
+
+static void systray_manager_message_remove_all(SystrayManager *manager);
+
+
+enum {
+    PROP_0,
+    PROP_STATS,
+    PROP_DOCK_SETTLE,
+    PROP_DOCK_BUDGET,
+    PROP_LAZY_EMBED
+};
+
 
 enum {
     ICON_ADDED,
+    ICONS_ADDED,
     ICON_REMOVED,
+    ICONS_REMOVED,
     MESSAGE_SENT,
     MESSAGE_CANCELLED,
     LOST_SELECTION,
@@ -89,6 +131,26 @@ struct _SystrayManagerClass {
 };
 
 
+/* a dock request waiting for its socket */
+typedef struct {
+    SystrayManager *manager;
+
+    /* the icon window and its visual, once known */
+    Window window;
+    VisualID visual_id;
+} SystrayManagerDock;
+
+
+/* handler for one client message type, returns TRUE if the event was consumed */
+typedef gboolean (*SystrayManagerDispatchFunc)(SystrayManager *manager,
+        XClientMessageEvent *xevent);
+
+typedef struct {
+    Atom message_type;
+    SystrayManagerDispatchFunc func;
+} SystrayManagerDispatch;
+
+
 struct _SystrayManager {
     GObject __parent__;
 
@@ -98,14 +160,54 @@ struct _SystrayManager {
     /* list of client sockets */
     GHashTable *sockets;
 
+    /* dock requests without a socket yet, keyed by window */
+    GHashTable *docks;
+
+    /* docks whose window attributes arrived, in request order */
+    GQueue docks_ready;
+
+    /* sockets already handed to the tray that did not fit into the budget
+     * of their batch, embedded first in the next one. holds a reference */
+    GQueue sockets_pending;
+
+    /* source creating the sockets for the ready docks */
+    guint docks_idle_id;
+
+    /* milliseconds to collect ready docks before creating their sockets,
+     * 0 to create them before the next frame */
+    guint dock_settle;
+
+    /* microseconds the sockets of one batch may take, 0 for no limit, and
+     * the time a socket took on average so far */
+    guint dock_budget;
+    gint64 dock_cost;
+
+    /* leave embedding the sockets to the user of the manager */
+    guint lazy_embed : 1;
+
     /* orientation of the tray */
     GtkOrientation orientation;
 
-    /* list of pending messages */
-    GSList *messages;
+    /* pending messages, keyed by the window sending them */
+    GHashTable *messages;
 
-    /* _net_system_tray_opcode atom */
-    Atom opcode_atom;
+    /* bytes allocated for pending messages */
+    gsize message_bytes;
+
+    /* source evicting stale messages */
+    guint message_timeout_id;
+
+    /* atoms of the display, interned once on register */
+    const Atom *atoms;
+
+    /* client message handlers, keyed by message type */
+    SystrayManagerDispatch dispatch[2];
+
+    /* counters, only copied out when somebody asks */
+    SystrayManagerStats stats;
+
+    /* monotonic time the selection was acquired, 0 if not registered */
+    gint64 registered_time;
 
     /* _net_system_tray_s%d atom */
     GdkAtom selection_atom;
@@ -126,6 +228,9 @@ struct _SystrayMessage {
     glong length;
     glong remaining_length;
     glong timeout;
+
+    /* monotonic time the last chunk was received */
+    gint64 last_activity;
 };
 
 
@@ -135,23 +240,71 @@ static guint systray_manager_signals[LAST_SIGNAL];
 G_DEFINE_TYPE(SystrayManager, systray_manager, G_TYPE_OBJECT)
 
 
+static SystrayManagerStats *
+systray_manager_stats_copy(const SystrayManagerStats *stats) {
+    return g_slice_dup(SystrayManagerStats, stats);
+}
+
+
+static void
+systray_manager_stats_free(SystrayManagerStats *stats) {
+    g_slice_free(SystrayManagerStats, stats);
+}
+
+
+G_DEFINE_BOXED_TYPE(SystrayManagerStats, systray_manager_stats,
+                    systray_manager_stats_copy, systray_manager_stats_free)
+
+
 static void
 systray_manager_class_init(SystrayManagerClass *klass) {
     GObjectClass *gobject_class;
 
     gobject_class = G_OBJECT_CLASS(klass);
+    gobject_class->get_property = systray_manager_get_property;
+    gobject_class->set_property = systray_manager_set_property;
     gobject_class->finalize = systray_manager_finalize;
 
+    g_object_class_install_property(gobject_class, PROP_STATS,
+            g_param_spec_boxed("stats", NULL, NULL, TYPE_SYSTRAY_MANAGER_STATS,
+            G_PARAM_READABLE));
+
+    g_object_class_install_property(gobject_class, PROP_DOCK_SETTLE,
+            g_param_spec_uint("dock-settle", NULL, NULL, 0, G_MAXUINT, 0,
+            G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_DOCK_BUDGET,
+            g_param_spec_uint("dock-budget", NULL, NULL, 0, G_MAXUINT,
+            SYSTRAY_DOCK_BUDGET_DEFAULT, G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_LAZY_EMBED,
+            g_param_spec_boolean("lazy-embed", NULL, NULL, FALSE,
+            G_PARAM_READWRITE));
+
     systray_manager_signals[ICON_ADDED] = g_signal_new(
         g_intern_static_string("icon-added"), G_OBJECT_CLASS_TYPE(klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT,
         G_TYPE_NONE, 1, GTK_TYPE_SOCKET);
 
+    /* all icons docked in one batch. icon-added is only emitted for them
+     * if nobody handles this one */
+    systray_manager_signals[ICONS_ADDED] = g_signal_new(
+        g_intern_static_string("icons-added"), G_OBJECT_CLASS_TYPE(klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE, 1, G_TYPE_PTR_ARRAY);
+
     systray_manager_signals[ICON_REMOVED] = g_signal_new(
         g_intern_static_string("icon-removed"), G_OBJECT_CLASS_TYPE(klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__OBJECT,
         G_TYPE_NONE, 1, GTK_TYPE_SOCKET);
 
+    /* all icons at once when the manager is unregistered. icon-removed is
+     * only emitted for them if nobody handles this one */
+    systray_manager_signals[ICONS_REMOVED] = g_signal_new(
+        g_intern_static_string("icons-removed"), G_OBJECT_CLASS_TYPE(klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE, 1, G_TYPE_PTR_ARRAY);
+
     systray_manager_signals[MESSAGE_SENT] = g_signal_new(
         g_intern_static_string("message-sent"), G_OBJECT_CLASS_TYPE(klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL,
@@ -174,8 +327,21 @@ static void
 systray_manager_init(SystrayManager *manager) {
     manager->invisible = NULL;
     manager->orientation = GTK_ORIENTATION_HORIZONTAL;
-    manager->messages = NULL;
+    manager->messages = g_hash_table_new(NULL, NULL);
+    manager->message_bytes = 0;
+    manager->message_timeout_id = 0;
+    manager->atoms = NULL;
+    memset(&manager->stats, 0, sizeof(manager->stats));
+    manager->registered_time = 0;
     manager->sockets = g_hash_table_new(NULL, NULL);
+    manager->docks = g_hash_table_new(NULL, NULL);
+    g_queue_init(&manager->docks_ready);
+    g_queue_init(&manager->sockets_pending);
+    manager->docks_idle_id = 0;
+    manager->dock_settle = 0;
+    manager->dock_budget = SYSTRAY_DOCK_BUDGET_DEFAULT;
+    manager->dock_cost = SYSTRAY_DOCK_COST_INITIAL;
+    manager->lazy_embed = FALSE;
 }
 
 
@@ -191,6 +357,62 @@ systray_manager_error_quark(void) {
 }
 
 
+static void
+systray_manager_set_property(GObject *object, guint prop_id, const GValue *value,
+        GParamSpec *pspec) {
+    SystrayManager *manager = SYSTRAY_MANAGER(object);
+
+    switch (prop_id) {
+        case PROP_DOCK_SETTLE:
+            manager->dock_settle = g_value_get_uint(value);
+            break;
+
+        case PROP_DOCK_BUDGET:
+            manager->dock_budget = g_value_get_uint(value);
+            break;
+
+        case PROP_LAZY_EMBED:
+            manager->lazy_embed = g_value_get_boolean(value);
+            break;
+
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+
+static void
+systray_manager_get_property(GObject *object, guint prop_id, GValue *value,
+        GParamSpec *pspec) {
+    SystrayManager *manager = SYSTRAY_MANAGER(object);
+    SystrayManagerStats stats;
+
+    switch (prop_id) {
+        case PROP_STATS:
+            systray_manager_get_stats(manager, &stats);
+            g_value_set_boxed(value, &stats);
+            break;
+
+        case PROP_DOCK_SETTLE:
+            g_value_set_uint(value, manager->dock_settle);
+            break;
+
+        case PROP_DOCK_BUDGET:
+            g_value_set_uint(value, manager->dock_budget);
+            break;
+
+        case PROP_LAZY_EMBED:
+            g_value_set_boolean(value, manager->lazy_embed);
+            break;
+
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+
 static void
 systray_manager_finalize(GObject *object) {
     SystrayManager *manager = SYSTRAY_MANAGER(object);
@@ -200,14 +422,12 @@ systray_manager_finalize(GObject *object) {
     /* destroy the hash table */
     g_hash_table_destroy(manager->sockets);
 
-    if (manager->messages) {
-        /* cleanup all pending messages */
-        g_slist_foreach(manager->messages, (GFunc)systray_manager_message_free,
-                        NULL);
+    /* the dock requests are dropped on unregister */
+    g_hash_table_destroy(manager->docks);
 
-        /* free the list */
-        g_slist_free(manager->messages);
-    }
+    /* cleanup all pending messages */
+    systray_manager_message_remove_all(manager);
+    g_hash_table_destroy(manager->messages);
 
     G_OBJECT_CLASS(systray_manager_parent_class)->finalize(object);
 }
@@ -249,26 +469,31 @@ systray_manager_check_running (GdkScreen *screen)
 
 
 static GdkFilterReturn
-client_message_filter(GdkXEvent *xevent, GdkEvent *event, gpointer data) {
-    XClientMessageEvent *evt;
-    GdkAtom message_type;
-
-    if (((XEvent *)xevent)->type != ClientMessage) {
+systray_manager_client_message_filter(GdkXEvent *xev, GdkEvent *event, gpointer user_data) {
+    XClientMessageEvent *xevent = (XClientMessageEvent *)xev;
+    SystrayManager *manager = user_data;
+    guint i;
+
+    /* tray messages are addressed to the icon windows, which gdk doesn't
+     * know about, so this filter sees every event of the application.
+     * leave everything but client messages alone as cheaply as possible */
+    manager->stats.n_events_seen++;
+    if (G_LIKELY(xevent->type != ClientMessage)) {
         return GDK_FILTER_CONTINUE;
     }
 
-    evt = (XClientMessageEvent *)xevent;
-
-    Atom opcode_atom = XInternAtom(evt->display, "_NET_SYSTEM_TRAY_OPCODE", FALSE);
-    Atom message_data_atom = XInternAtom(evt->display, "_NET_SYSTEM_TRAY_MESSAGE_DATA", FALSE);
+    for (i = 0; i < G_N_ELEMENTS(manager->dispatch); i++) {
+        if (manager->dispatch[i].message_type == xevent->message_type) {
+            if (manager->dispatch[i].func(manager, xevent)) {
+                manager->stats.n_events_handled++;
+                return GDK_FILTER_REMOVE;
+            }
 
-    if (evt->message_type == opcode_atom) {
-        return systray_manager_handle_client_message_opcode(event, xevent, data);
-    } else if (evt->message_type == message_data_atom) {
-        return systray_manager_handle_client_message_message_data(event, xevent, data);
-    } else {
-        return GDK_FILTER_CONTINUE;
+            break;
+        }
     }
+
+    return GDK_FILTER_CONTINUE;
 }
 
 
@@ -280,7 +505,6 @@ systray_manager_register(SystrayManager *manager, GdkScreen *screen, GError **er
     gint screen_number;
     GtkWidget *invisible;
     guint32 timestamp;
-    GdkAtom opcode_atom;
     XClientMessageEvent xevent;
     Window root_window;
 
@@ -313,16 +537,21 @@ systray_manager_register(SystrayManager *manager, GdkScreen *screen, GError **er
     /* set the invisible window and take a reference */
     manager->invisible = g_object_ref(G_OBJECT(invisible));
 
+    /* intern all the atoms we need for this display */
+    manager->atoms = systray_atoms_get(display);
+
     /* set the visial property for transparent tray icons */
     systray_manager_set_visual(manager);
 
     /* get the current x server time stamp */
     timestamp = gdk_x11_get_server_time(gtk_widget_get_window(invisible));
 
-    /* try to become the selection owner of this display */
+    /* try to become the selection owner of this display. gdk reads the
+     * owner back to find out if it worked */
     succeed = gdk_selection_owner_set_for_display(
         display, gtk_widget_get_window(invisible), manager->selection_atom,
         timestamp, TRUE);
+    manager->stats.n_round_trips += 2;
 
     if (G_LIKELY(succeed)) {
         /* get the root window */
@@ -331,8 +560,7 @@ systray_manager_register(SystrayManager *manager, GdkScreen *screen, GError **er
         /* send a message to x11 that we're going to handle this display */
         xevent.type = ClientMessage;
         xevent.window = root_window;
-        xevent.message_type =
-            gdk_x11_get_xatom_by_name_for_display(display, "MANAGER");
+        xevent.message_type = manager->atoms[SYSTRAY_ATOM_MANAGER];
         xevent.format = 32;
         xevent.data.l[0] = timestamp;
         xevent.data.l[1] =
@@ -346,15 +574,24 @@ systray_manager_register(SystrayManager *manager, GdkScreen *screen, GError **er
         XSendEvent(GDK_DISPLAY_XDISPLAY(display), root_window, False,
                    StructureNotifyMask, (XEvent *)&xevent);
 
+        /* icons wait for this message before they dock, don't leave it in
+         * the output buffer until the main loop gets around to it */
+        gdk_display_flush(display);
+        manager->registered_time = g_get_monotonic_time();
+
         /* system_tray_request_dock and selectionclear */
         gdk_window_add_filter(gtk_widget_get_window(invisible),
                               systray_manager_window_filter, manager);
 
-        /* get the opcode atom (for both gdk and x11) */
-        opcode_atom = gdk_atom_intern("_NET_SYSTEM_TRAY_OPCODE", FALSE);
-        manager->opcode_atom = gdk_x11_atom_to_xatom_for_display(display, opcode_atom);
+        /* opcode and message data sent by the tray icons */
+        manager->dispatch[0].message_type =
+            manager->atoms[SYSTRAY_ATOM_NET_SYSTEM_TRAY_OPCODE];
+        manager->dispatch[0].func = systray_manager_handle_client_message_opcode;
+        manager->dispatch[1].message_type =
+            manager->atoms[SYSTRAY_ATOM_NET_SYSTEM_TRAY_MESSAGE_DATA];
+        manager->dispatch[1].func = systray_manager_handle_client_message_message_data;
 
-        gdk_window_add_filter(NULL, client_message_filter, manager);
+        gdk_window_add_filter(NULL, systray_manager_client_message_filter, manager);
 
         g_debug("registered manager on screen %d", screen_number);
     } else {
@@ -389,6 +626,38 @@ systray_manager_remove_socket(gpointer key, gpointer value, gpointer user_data)
 }
 
 
+static void
+systray_manager_remove_sockets(SystrayManager *manager) {
+    GPtrArray *sockets;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (g_hash_table_size(manager->sockets) == 0) {
+        return;
+    }
+
+    if (!g_signal_has_handler_pending(manager, systray_manager_signals[ICONS_REMOVED],
+                                      0, FALSE)) {
+        /* one by one for handlers that only know about single icons */
+        g_hash_table_foreach(manager->sockets, systray_manager_remove_socket, manager);
+    } else {
+        sockets = g_ptr_array_sized_new(g_hash_table_size(manager->sockets));
+
+        g_hash_table_iter_init(&iter, manager->sockets);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            g_ptr_array_add(sockets, value);
+        }
+
+        /* a single emission, so the tray can tear down all icons at once */
+        g_signal_emit(manager, systray_manager_signals[ICONS_REMOVED], 0, sockets);
+
+        g_ptr_array_unref(sockets);
+    }
+
+    g_hash_table_remove_all(manager->sockets);
+}
+
+
 void
 systray_manager_unregister(SystrayManager *manager) {
     GdkDisplay *display;
@@ -411,18 +680,31 @@ systray_manager_unregister(SystrayManager *manager) {
 
     /* remove our handling of the selection if we're the owner */
     owner = gdk_selection_owner_get_for_display(display, manager->selection_atom);
+    manager->stats.n_round_trips++;
     if (owner == gtk_widget_get_window(invisible)) {
         gdk_selection_owner_set_for_display(
             display, NULL, manager->selection_atom,
             gdk_x11_get_server_time(gtk_widget_get_window(invisible)), TRUE);
+        manager->stats.n_round_trips += 2;
     }
 
     /* remove window filter */
     gdk_window_remove_filter(gtk_widget_get_window(invisible),
                              systray_manager_window_filter, manager);
 
+    /* remove the client message filter */
+    gdk_window_remove_filter(NULL, systray_manager_client_message_filter, manager);
+
     /* remove all sockets from the hash table */
-    g_hash_table_foreach(manager->sockets, systray_manager_remove_socket, manager);
+    systray_manager_remove_sockets(manager);
+
+    /* forget about icons that didn't get a socket yet */
+    systray_manager_dock_remove_all(manager);
+
+    /* drop all pending messages */
+    systray_manager_message_remove_all(manager);
+
+    manager->registered_time = 0;
 
     /* destroy and unref the invisible window */
     manager->invisible = NULL;
@@ -441,7 +723,7 @@ systray_manager_window_filter(GdkXEvent *xev, GdkEvent *event, gpointer user_dat
     g_return_val_if_fail(IS_SYSTRAY_MANAGER(manager), GDK_FILTER_CONTINUE);
 
     if (xevent->type == ClientMessage) {
-        if (xevent->xclient.message_type == manager->opcode_atom &&
+        if (xevent->xclient.message_type == manager->atoms[SYSTRAY_ATOM_NET_SYSTEM_TRAY_OPCODE] &&
             xevent->xclient.data.l[1] == SYSTRAY_MANAGER_REQUEST_DOCK) {
             /* dock a tray icon */
             systray_manager_handle_dock_request(manager,
@@ -461,88 +743,78 @@ systray_manager_window_filter(GdkXEvent *xev, GdkEvent *event, gpointer user_dat
 }
 
 
-static GdkFilterReturn
-systray_manager_handle_client_message_opcode(GdkXEvent *xevent, GdkEvent *event,
-        gpointer user_data) {
-    XClientMessageEvent *xev;
-    SystrayManager *manager = SYSTRAY_MANAGER(user_data);
-
-    g_return_val_if_fail(IS_SYSTRAY_MANAGER(manager), GDK_FILTER_REMOVE);
-
-    /* cast to x11 event */
-    xev = (XClientMessageEvent *)xevent;
+static gboolean
+systray_manager_handle_client_message_opcode(SystrayManager *manager,
+        XClientMessageEvent *xevent) {
+    g_return_val_if_fail(IS_SYSTRAY_MANAGER(manager), FALSE);
 
-    switch (xev->data.l[1]) {
+    switch (xevent->data.l[1]) {
         case SYSTRAY_MANAGER_REQUEST_DOCK:
             /* handled in systray_manager_window_filter () */
             break;
 
         case SYSTRAY_MANAGER_BEGIN_MESSAGE:
-            systray_manager_handle_begin_message(manager, xev);
-            return GDK_FILTER_REMOVE;
+            systray_manager_handle_begin_message(manager, xevent);
+            return TRUE;
 
         case SYSTRAY_MANAGER_CANCEL_MESSAGE:
-            systray_manager_handle_cancel_message(manager, xev);
-            return GDK_FILTER_REMOVE;
+            systray_manager_handle_cancel_message(manager, xevent);
+            return TRUE;
 
         default:
             break;
     }
 
-    return GDK_FILTER_CONTINUE;
+    return FALSE;
 }
 
 
-static GdkFilterReturn
-systray_manager_handle_client_message_message_data(GdkXEvent *xevent, GdkEvent *event,
-        gpointer user_data) {
-    XClientMessageEvent *xev = xevent;
-    SystrayManager *manager = SYSTRAY_MANAGER(user_data);
-    GSList *li;
+static gboolean
+systray_manager_handle_client_message_message_data(SystrayManager *manager,
+        XClientMessageEvent *xev) {
     SystrayMessage *message;
     glong length;
     GtkSocket *socket;
 
-    g_return_val_if_fail(IS_SYSTRAY_MANAGER(manager), GDK_FILTER_REMOVE);
-
-    /* try to find the pending message in the list */
-    for (li = manager->messages; li != NULL; li = li->next) {
-        message = li->data;
-
-        if (xev->window == message->window) {
-            /* copy the data of this message */
-            length = MIN(message->remaining_length, 20);
-            memcpy(
-                (message->string + message->length - message->remaining_length),
-                &xev->data, length);
-            message->remaining_length -= length;
-
-            /* check if we have the complete message */
-            if (message->remaining_length == 0) {
-                /* try to get the socket from the known tray icons */
-                socket = g_hash_table_lookup(manager->sockets,
-                                             GUINT_TO_POINTER(message->window));
-
-                if (G_LIKELY(socket)) {
-                    /* known socket, send the signal */
-                    g_signal_emit(
-                        manager, systray_manager_signals[MESSAGE_SENT], 0,
-                        socket, message->string, message->id, message->timeout);
-                }
-
-                /* delete the message from the list */
-                manager->messages = g_slist_delete_link(manager->messages, li);
-
-                /* free the message */
-                systray_manager_message_free(message);
-            }
+    g_return_val_if_fail(IS_SYSTRAY_MANAGER(manager), TRUE);
 
-            /* stop searching */
-            break;
+    /* data chunks don't carry the message id, there can only be one
+     * message in progress per window */
+    message = g_hash_table_lookup(manager->messages, GUINT_TO_POINTER(xev->window));
+    if (G_UNLIKELY(message == NULL)) {
+        return TRUE;
+    }
+
+    /* copy the data of this message */
+    length = MIN(message->remaining_length, 20);
+    memcpy((message->string + message->length - message->remaining_length),
+           &xev->data, length);
+    message->remaining_length -= length;
+    message->last_activity = g_get_monotonic_time();
+
+    manager->stats.n_message_chunks++;
+    manager->stats.n_message_bytes += length;
+
+    /* check if we have the complete message */
+    if (message->remaining_length == 0) {
+        /* take the message out of the table before emitting */
+        g_hash_table_remove(manager->messages, GUINT_TO_POINTER(message->window));
+
+        /* try to get the socket from the known tray icons */
+        socket = g_hash_table_lookup(manager->sockets,
+                                     GUINT_TO_POINTER(message->window));
+
+        if (G_LIKELY(socket)) {
+            /* known socket, send the signal */
+            g_signal_emit(manager, systray_manager_signals[MESSAGE_SENT], 0,
+                          socket, message->string, message->id, message->timeout);
         }
+
+        /* free the message */
+        systray_manager_message_free(manager, message);
     }
 
-    return GDK_FILTER_REMOVE;
+    return TRUE;
 }
 
 
@@ -562,8 +834,8 @@ systray_manager_handle_begin_message(SystrayManager *manager, XClientMessageEven
         return;
     }
 
-    /* remove the same message from the list */
-    systray_manager_message_remove_from_list(manager, xevent);
+    /* a new message replaces the one the icon was sending before */
+    systray_manager_message_remove(manager, xevent->window);
 
     /* get some message information */
     timeout = xevent->data.l[2];
@@ -574,20 +846,18 @@ systray_manager_handle_begin_message(SystrayManager *manager, XClientMessageEven
         /* directly emit empty messages */
         g_signal_emit(manager, systray_manager_signals[MESSAGE_SENT], 0, socket, "", id, timeout);
     } else {
-        /* create new structure */
-        message = g_slice_new0(SystrayMessage);
-
-        /* set message data */
-        message->window = xevent->window;
-        message->timeout = timeout;
-        message->length = length;
-        message->id = id;
-        message->remaining_length = length;
-        message->string = g_malloc(length + 1);
-        message->string[length] = '\0';
+        /* allocate the message from the pool, this fails if the icon or
+         * all icons together exceed their budget */
+        message = systray_manager_message_new(manager, xevent);
+        if (G_UNLIKELY(message == NULL)) {
+            g_debug("dropped message %ld of %ld bytes from window %lu", id,
+                    length, (gulong)xevent->window);
+            return;
+        }
 
-        /* add this message to the list of pending messages */
-        manager->messages = g_slist_prepend(manager->messages, message);
+        /* add this message to the pending messages */
+        g_hash_table_insert(manager->messages, GUINT_TO_POINTER(message->window),
+                            message);
     }
 }
 
@@ -595,63 +865,103 @@ systray_manager_handle_begin_message(SystrayManager *manager, XClientMessageEven
 static void
 systray_manager_handle_cancel_message(SystrayManager *manager, XClientMessageEvent *xevent) {
     GtkSocket *socket;
-    Window window = xevent->data.l[2];
+    SystrayMessage *message;
+    glong id = xevent->data.l[2];
 
     g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
 
-    /* remove the same message from the list */
-    systray_manager_message_remove_from_list(manager, xevent);
+    /* remove the message if it is still in progress */
+    message = g_hash_table_lookup(manager->messages, GUINT_TO_POINTER(xevent->window));
+    if (message != NULL && message->id == id) {
+        systray_manager_message_remove(manager, xevent->window);
+        manager->stats.n_messages_cancelled++;
+    }
 
     /* try to find the window in the list of known tray icons */
     socket = g_hash_table_lookup(manager->sockets, GUINT_TO_POINTER(xevent->window));
 
     /* emit the cancelled signal */
     if (G_LIKELY(socket != NULL)) {
-        g_signal_emit(manager, systray_manager_signals[MESSAGE_CANCELLED], 0, socket, window);
+        g_signal_emit(manager, systray_manager_signals[MESSAGE_CANCELLED], 0, socket, id);
     }
 }
 
 
-static void
-systray_manager_handle_dock_request(SystrayManager *manager, XClientMessageEvent *xevent) {
-    GtkWidget *socket;
-    GdkScreen *screen;
-    Window window = xevent->data.l[2];
+static GdkVisual *
+systray_manager_lookup_visual(GdkScreen *screen, VisualID visual_id) {
+    static GQuark quark = 0;
+    GHashTable *visuals;
+    GdkVisual *visual;
 
-    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
-    g_return_if_fail(GTK_IS_INVISIBLE(manager->invisible));
+    if (G_UNLIKELY(quark == 0)) {
+        quark = g_quark_from_static_string("systray-visuals");
+    }
 
-    /* check if we already have this window */
-    if (g_hash_table_lookup(manager->sockets, GUINT_TO_POINTER(window)) != NULL) {
-        return;
+    /* gdk searches the visuals of the screen linearly, most icons share a
+     * handful of them, so remember the ones we've seen per screen */
+    visuals = g_object_get_qdata(G_OBJECT(screen), quark);
+    if (G_UNLIKELY(visuals == NULL)) {
+        visuals = g_hash_table_new(NULL, NULL);
+        g_object_set_qdata_full(G_OBJECT(screen), quark, visuals,
+                                (GDestroyNotify)g_hash_table_destroy);
     }
 
-    /* create the socket */
-    screen = gtk_widget_get_screen(manager->invisible);
-    socket = systray_socket_new(screen, window);
-    if (G_UNLIKELY(socket == NULL)) {
-        return;
+    visual = g_hash_table_lookup(visuals, GUINT_TO_POINTER(visual_id));
+    if (visual == NULL) {
+        visual = gdk_x11_screen_lookup_visual(screen, visual_id);
+        if (G_LIKELY(visual != NULL)) {
+            g_hash_table_insert(visuals, GUINT_TO_POINTER(visual_id), visual);
+        }
     }
 
-    /* add the icon to the tray */
-    g_signal_emit(manager, systray_manager_signals[ICON_ADDED], 0, socket);
+    return visual;
+}
+
+
+static void
+systray_manager_dock_free(SystrayManagerDock *dock) {
+    g_slice_free(SystrayManagerDock, dock);
+}
+
+
+static void
+systray_manager_client_gone(SystrayManager *manager, GtkWidget *socket) {
+    gboolean handled = FALSE;
+
+    /* undock it like gtk does when a client goes away */
+    g_object_ref(G_OBJECT(socket));
+    g_signal_emit_by_name(socket, "plug-removed", &handled);
+    if (!handled) {
+        gtk_widget_destroy(socket);
+    }
+    g_object_unref(G_OBJECT(socket));
+}
+
+
+static void
+systray_manager_embed_socket(SystrayManager *manager, GtkWidget *socket) {
+    Window window = systray_socket_get_window(SYSTRAY_SOCKET(socket));
 
     /* check if the widget has been attached. if the widget has no
        toplevel window, we cannot set the socket id. */
     if (G_LIKELY(GTK_IS_WINDOW(gtk_widget_get_toplevel(socket)))) {
-        /* signal to monitor if the client is removed from the socket */
-        g_signal_connect(G_OBJECT(socket), "plug-removed",
-                         G_CALLBACK(systray_manager_handle_undock_request),
-                         manager);
-
-        /* register the xembed client window id for this socket */
-        gtk_socket_add_id(GTK_SOCKET(socket), window);
-
-        /* add the socket to the list of known sockets */
-        g_hash_table_insert(manager->sockets, GUINT_TO_POINTER(window), socket);
+        manager->stats.n_docks++;
+
+        /* register the xembed client window id for this socket. when lazy,
+           the client stays docked and is only watched until the tray embeds
+           it */
+        if (manager->lazy_embed) {
+            systray_socket_watch_client(SYSTRAY_SOCKET(socket));
+        } else if (systray_socket_embed(SYSTRAY_SOCKET(socket)) &&
+                   gtk_socket_get_plug_window(GTK_SOCKET(socket)) == NULL) {
+            /* the client went away while the socket waited for its turn */
+            systray_manager_client_gone(manager, socket);
+        }
     } else {
         /* warning */
         g_warning("No parent window set, destroying socket");
+        manager->stats.n_dock_failures++;
+        g_hash_table_remove(manager->sockets, GUINT_TO_POINTER(window));
 
         /* not attached successfully, destroy it */
         gtk_widget_destroy(socket);
@@ -659,6 +969,249 @@ systray_manager_handle_dock_request(SystrayManager *manager, XClientMessageEvent
 }
 
 
+static gboolean
+systray_manager_dock_budget_spent(SystrayManager *manager, gint64 start) {
+    return manager->dock_budget > 0 &&
+           g_get_monotonic_time() - start >= (gint64)manager->dock_budget;
+}
+
+
+static void
+systray_manager_embed_pending(SystrayManager *manager, gint64 start, guint *n_embedded) {
+    GtkWidget *socket;
+    Window window;
+
+    /* at least one per batch, so the queue always moves */
+    while (!g_queue_is_empty(&manager->sockets_pending)) {
+        if (*n_embedded > 0 && systray_manager_dock_budget_spent(manager, start)) {
+            break;
+        }
+
+        socket = g_queue_pop_head(&manager->sockets_pending);
+        window = systray_socket_get_window(SYSTRAY_SOCKET(socket));
+
+        /* the manager may have given up on it meanwhile */
+        if (g_hash_table_lookup(manager->sockets, GUINT_TO_POINTER(window)) == socket) {
+            systray_manager_embed_socket(manager, socket);
+            (*n_embedded)++;
+        }
+
+        g_object_unref(G_OBJECT(socket));
+    }
+}
+
+
+static gboolean
+systray_manager_dock_idle(gpointer user_data) {
+    SystrayManager *manager = SYSTRAY_MANAGER(user_data);
+    SystrayManagerDock *dock;
+    GdkScreen *screen;
+    GdkVisual *visual;
+    GtkWidget *socket;
+    GPtrArray *sockets;
+    gint64 start, elapsed;
+    guint i, n_docks, n_embedded = 0;
+
+    start = g_get_monotonic_time();
+
+    /* the sockets left over from the last batch are in the tray already */
+    systray_manager_embed_pending(manager, start, &n_embedded);
+
+    /* the first guess of how many new docks fit into the rest of the
+     * budget, judged by what a socket cost so far. the clock is checked
+     * while they are created and embedded */
+    n_docks = g_queue_get_length(&manager->docks_ready);
+    if (manager->dock_budget > 0) {
+        elapsed = g_get_monotonic_time() - start;
+        n_docks = MIN(n_docks, MAX((gint64)manager->dock_budget - elapsed, 0) /
+                                   MAX(manager->dock_cost, 1));
+        if (n_embedded == 0 && !g_queue_is_empty(&manager->docks_ready)) {
+            n_docks = MAX(n_docks, 1);
+        }
+    }
+
+    screen = gtk_widget_get_screen(manager->invisible);
+    sockets = g_ptr_array_sized_new(n_docks);
+
+    /* create the sockets of all docks of this batch in one go, so the tray
+     * is relayouted once instead of once per icon */
+    for (i = 0; i < n_docks; i++) {
+        if ((i > 0 || n_embedded > 0) &&
+            systray_manager_dock_budget_spent(manager, start)) {
+            break;
+        }
+
+        dock = g_queue_pop_head(&manager->docks_ready);
+        g_hash_table_remove(manager->docks, GUINT_TO_POINTER(dock->window));
+
+        visual = systray_manager_lookup_visual(screen, dock->visual_id);
+        socket = visual != NULL ? systray_socket_new(screen, dock->window, visual) : NULL;
+        if (G_LIKELY(socket != NULL)) {
+            g_ptr_array_add(sockets, socket);
+
+            /* known from now on, so the client can't dock twice. whoever
+             * embeds it, an undock goes through the manager */
+            g_hash_table_insert(manager->sockets, GUINT_TO_POINTER(dock->window), socket);
+            g_signal_connect(G_OBJECT(socket), "plug-removed",
+                             G_CALLBACK(systray_manager_handle_undock_request),
+                             manager);
+        } else {
+            manager->stats.n_dock_failures++;
+        }
+
+        systray_manager_dock_free(dock);
+    }
+
+    /* add the icons to the tray */
+    if (sockets->len > 0 &&
+        g_signal_has_handler_pending(manager, systray_manager_signals[ICONS_ADDED], 0,
+                                     FALSE)) {
+        g_signal_emit(manager, systray_manager_signals[ICONS_ADDED], 0, sockets);
+    } else {
+        for (i = 0; i < sockets->len; i++) {
+            g_signal_emit(manager, systray_manager_signals[ICON_ADDED], 0,
+                          g_ptr_array_index(sockets, i));
+        }
+    }
+
+    /* embed as many as the budget still allows, the rest is embedded in
+     * the next batch */
+    for (i = 0; i < sockets->len; i++) {
+        g_queue_push_tail(&manager->sockets_pending,
+                          g_object_ref(G_OBJECT(g_ptr_array_index(sockets, i))));
+    }
+    systray_manager_embed_pending(manager, start, &n_embedded);
+
+    elapsed = g_get_monotonic_time() - start;
+    manager->stats.n_dock_batches++;
+    manager->stats.dock_time_total += elapsed;
+    manager->stats.dock_time_max = MAX(manager->stats.dock_time_max, (guint64)elapsed);
+    manager->stats.dock_queue_depth = g_queue_get_length(&manager->docks_ready);
+
+    /* a moving average, so one slow client doesn't stall the next batches */
+    if (sockets->len > 0 || n_embedded > 0) {
+        manager->dock_cost =
+            (3 * manager->dock_cost + elapsed / MAX(sockets->len, n_embedded)) / 4;
+    }
+
+    g_ptr_array_unref(sockets);
+
+    if (g_queue_is_empty(&manager->docks_ready) &&
+        g_queue_is_empty(&manager->sockets_pending)) {
+        manager->docks_idle_id = 0;
+        return FALSE;
+    }
+
+    /* carry the rest over, at a priority that lets the next frame be
+     * drawn first */
+    manager->docks_idle_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                                             systray_manager_dock_idle, manager, NULL);
+    return FALSE;
+}
+
+
+static void
+systray_manager_dock_attributes_reply(gpointer reply, xcb_generic_error_t *error,
+                                      gpointer user_data) {
+    xcb_get_window_attributes_reply_t *attr = reply;
+    SystrayManagerDock *dock = user_data;
+    SystrayManager *manager = dock->manager;
+
+    /* leave on an error or if the window does not exist anymore */
+    if (attr == NULL) {
+        manager->stats.n_dock_failures++;
+        g_hash_table_remove(manager->docks, GUINT_TO_POINTER(dock->window));
+        systray_manager_dock_free(dock);
+        return;
+    }
+
+    dock->visual_id = attr->visual;
+    g_queue_push_tail(&manager->docks_ready, dock);
+
+    manager->stats.dock_queue_depth = g_queue_get_length(&manager->docks_ready);
+    manager->stats.dock_queue_depth_max = MAX(manager->stats.dock_queue_depth_max,
+                                              manager->stats.dock_queue_depth);
+
+    /* the other replies of this batch are delivered before the idle runs,
+     * which is before the next frame is laid out. with a settle window the
+     * docks of a startup storm are collected for a bit longer */
+    if (manager->docks_idle_id == 0) {
+        if (manager->dock_settle > 0) {
+            manager->docks_idle_id = g_timeout_add_full(
+                G_PRIORITY_HIGH_IDLE, manager->dock_settle, systray_manager_dock_idle,
+                manager, NULL);
+        } else {
+            manager->docks_idle_id = g_idle_add_full(
+                G_PRIORITY_HIGH_IDLE, systray_manager_dock_idle, manager, NULL);
+        }
+    }
+}
+
+
+static void
+systray_manager_dock_remove_all(SystrayManager *manager) {
+    GdkDisplay *display;
+    GHashTableIter iter;
+    gpointer dock;
+
+    if (manager->docks_idle_id != 0) {
+        g_source_remove(manager->docks_idle_id);
+        manager->docks_idle_id = 0;
+    }
+
+    /* the ready docks are in the hash table as well */
+    g_queue_clear(&manager->docks_ready);
+    manager->stats.dock_queue_depth = 0;
+
+    /* the sockets not embedded yet were removed with the others */
+    g_queue_foreach(&manager->sockets_pending, (GFunc)g_object_unref, NULL);
+    g_queue_clear(&manager->sockets_pending);
+
+    display = gtk_widget_get_display(manager->invisible);
+
+    g_hash_table_iter_init(&iter, manager->docks);
+    while (g_hash_table_iter_next(&iter, NULL, &dock)) {
+        /* the reply will be dropped when it arrives */
+        systray_async_cancel(display, dock);
+        systray_manager_dock_free(dock);
+    }
+
+    g_hash_table_remove_all(manager->docks);
+}
+
+
+static void
+systray_manager_handle_dock_request(SystrayManager *manager, XClientMessageEvent *xevent) {
+    SystrayManagerDock *dock;
+    GdkDisplay *display;
+    xcb_get_window_attributes_cookie_t cookie;
+    Window window = xevent->data.l[2];
+
+    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
+    g_return_if_fail(GTK_IS_INVISIBLE(manager->invisible));
+
+    /* check if we already have this window */
+    if (g_hash_table_lookup(manager->sockets, GUINT_TO_POINTER(window)) != NULL ||
+        g_hash_table_lookup(manager->docks, GUINT_TO_POINTER(window)) != NULL) {
+        return;
+    }
+
+    dock = g_slice_new0(SystrayManagerDock);
+    dock->manager = manager;
+    dock->window = window;
+    g_hash_table_insert(manager->docks, GUINT_TO_POINTER(window), dock);
+
+    /* ask for the visual of the icon without waiting for the answer. when
+     * many icons dock at once, all the requests are on the wire together
+     * and the sockets are created in a batch once the replies are in */
+    display = gtk_widget_get_display(manager->invisible);
+    cookie = xcb_get_window_attributes(systray_async_get_connection(display), window);
+    systray_async_add(display, cookie.sequence, systray_manager_dock_attributes_reply,
+                      dock);
+    systray_async_flush(display);
+}
+
+
 static gboolean
 systray_manager_handle_undock_request(GtkSocket *socket, gpointer user_data) {
     SystrayManager *manager = SYSTRAY_MANAGER(user_data);
@@ -669,6 +1222,10 @@ systray_manager_handle_undock_request(GtkSocket *socket, gpointer user_data) {
     /* remove the socket from the list */
     window = systray_socket_get_window(SYSTRAY_SOCKET(socket));
     g_hash_table_remove(manager->sockets, GUINT_TO_POINTER(window));
+    manager->stats.n_undocks++;
+
+    /* drop a message the icon didn't finish */
+    systray_manager_message_remove(manager, window);
 
     /* emit signal that the socket will be removed */
     g_signal_emit(manager, systray_manager_signals[ICON_REMOVED], 0, socket);
@@ -678,11 +1235,25 @@ systray_manager_handle_undock_request(GtkSocket *socket, gpointer user_data) {
 }
 
 
+void
+systray_manager_update_visual(SystrayManager *manager) {
+    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
+
+    if (G_UNLIKELY(manager->invisible == NULL)) {
+        return;
+    }
+
+    /* advertise the visual for icons docking from now on. the embedded ones
+     * keep their windows, whether they are composited only depends on their
+     * visual, which doesn't change */
+    systray_manager_set_visual(manager);
+}
+
+
 static void
 systray_manager_set_visual(SystrayManager *manager) {
     GdkDisplay *display;
     Visual *xvisual;
-    Atom visual_atom;
     gulong data[1];
     GdkScreen *screen;
 
@@ -694,10 +1265,6 @@ systray_manager_set_visual(SystrayManager *manager) {
     display = gtk_widget_get_display(manager->invisible);
     screen = gtk_invisible_get_screen(GTK_INVISIBLE(manager->invisible));
 
-    /* get the xatom for the visual property */
-    visual_atom = gdk_x11_get_xatom_by_name_for_display(
-        display, "_NET_SYSTEM_TRAY_VISUAL");
-
     if (gtk_widget_is_composited(manager->invisible) &&
         gdk_screen_get_rgba_visual(screen) != NULL &&
         gdk_display_supports_composite(display)) {
@@ -711,15 +1278,25 @@ systray_manager_set_visual(SystrayManager *manager) {
     data[0] = XVisualIDFromVisual(xvisual);
     XChangeProperty(GDK_DISPLAY_XDISPLAY(display),
                     GDK_WINDOW_XID(gtk_widget_get_window(manager->invisible)),
-                    visual_atom, XA_VISUALID, 32, PropModeReplace,
+                    manager->atoms[SYSTRAY_ATOM_NET_SYSTEM_TRAY_VISUAL], XA_VISUALID, 32, PropModeReplace,
                     (guchar *)&data, 1);
 }
 
 
+void
+systray_manager_get_event_counts(SystrayManager *manager, guint64 *n_seen,
+                                 guint64 *n_handled) {
+    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
+
+    if (n_seen != NULL) *n_seen = manager->stats.n_events_seen;
+
+    if (n_handled != NULL) *n_handled = manager->stats.n_events_handled;
+}
+
+
 void
 systray_manager_set_orientation(SystrayManager *manager, GtkOrientation orientation) {
     GdkDisplay *display;
-    Atom orientation_atom;
     gulong data[1];
 
     g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
@@ -732,10 +1309,6 @@ systray_manager_set_orientation(SystrayManager *manager, GtkOrientation orientat
     /* get invisible display */
     display = gtk_widget_get_display(manager->invisible);
 
-    /* get the xatom for the orientation property */
-    orientation_atom = gdk_x11_get_xatom_by_name_for_display(
-        display, "_NET_SYSTEM_TRAY_ORIENTATION");
-
     /* set the data we're going to send to x */
     data[0] = (manager->orientation == GTK_ORIENTATION_HORIZONTAL
                    ? SYSTRAY_MANAGER_ORIENTATION_HORIZONTAL
@@ -744,7 +1317,7 @@ systray_manager_set_orientation(SystrayManager *manager, GtkOrientation orientat
     /* change the x property */
     XChangeProperty(GDK_DISPLAY_XDISPLAY(display),
                     GDK_WINDOW_XID(gtk_widget_get_window(manager->invisible)),
-                    orientation_atom, XA_CARDINAL, 32, PropModeReplace,
+                    manager->atoms[SYSTRAY_ATOM_NET_SYSTEM_TRAY_ORIENTATION], XA_CARDINAL, 32, PropModeReplace,
                     (guchar *)&data, 1);
 }
 
@@ -752,34 +1325,155 @@ systray_manager_set_orientation(SystrayManager *manager, GtkOrientation orientat
 /**
  * tray messages
  **/
+static gboolean
+systray_manager_message_expire(gpointer key, gpointer value, gpointer user_data) {
+    SystrayManager *manager = SYSTRAY_MANAGER(user_data);
+    SystrayMessage *message = value;
+    gint64 now = g_get_monotonic_time();
+
+    if (now - message->last_activity < SYSTRAY_MESSAGE_TIMEOUT * G_USEC_PER_SEC) {
+        return FALSE;
+    }
+
+    g_debug("message %ld from window %lu timed out", message->id,
+            (gulong)message->window);
+
+    systray_manager_message_free(manager, message);
+
+    return TRUE;
+}
+
+
+static gboolean
+systray_manager_message_timeout(gpointer user_data) {
+    SystrayManager *manager = SYSTRAY_MANAGER(user_data);
+
+    /* drop messages of which we didn't receive a chunk for too long */
+    g_hash_table_foreach_remove(manager->messages, systray_manager_message_expire,
+                                manager);
+
+    /* only keep running while there are messages in progress */
+    if (g_hash_table_size(manager->messages) == 0) {
+        manager->message_timeout_id = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static SystrayMessage *
+systray_manager_message_new(SystrayManager *manager, XClientMessageEvent *xevent) {
+    SystrayMessage *message;
+    glong length = xevent->data.l[3];
+
+    /* refuse messages that don't fit in the budget of the icon or the
+     * remaining budget of all icons */
+    if (length < 0 || length > SYSTRAY_MESSAGE_CLIENT_BUDGET ||
+        manager->message_bytes + length + 1 > SYSTRAY_MESSAGE_GLOBAL_BUDGET) {
+        return NULL;
+    }
+
+    /* create new structure */
+    message = g_slice_new0(SystrayMessage);
+
+    /* set message data */
+    message->window = xevent->window;
+    message->timeout = xevent->data.l[2];
+    message->length = length;
+    message->id = xevent->data.l[4];
+    message->remaining_length = length;
+    message->last_activity = g_get_monotonic_time();
+    message->string = g_malloc(length + 1);
+    message->string[length] = '\0';
+
+    manager->message_bytes += length + 1;
+
+    /* start evicting stale messages */
+    if (manager->message_timeout_id == 0) {
+        manager->message_timeout_id = g_timeout_add_seconds(
+            SYSTRAY_MESSAGE_TIMEOUT, systray_manager_message_timeout, manager);
+    }
+
+    return message;
+}
+
+
 static void
-systray_manager_message_free(SystrayMessage *message) {
+systray_manager_message_free(SystrayManager *manager, SystrayMessage *message) {
+    /* return the bytes to the pool */
+    manager->message_bytes -= message->length + 1;
+
     g_free(message->string);
     g_slice_free(SystrayMessage, message);
 }
 
 
 static void
-systray_manager_message_remove_from_list(SystrayManager *manager, XClientMessageEvent *xevent) {
-    GSList *li;
+systray_manager_message_remove(SystrayManager *manager, Window window) {
     SystrayMessage *message;
 
     g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
 
-    /* seach for the same message in the list of pending messages */
-    for (li = manager->messages; li != NULL; li = li->next) {
-        message = li->data;
+    message = g_hash_table_lookup(manager->messages, GUINT_TO_POINTER(window));
+    if (message != NULL) {
+        /* delete the message from the table */
+        g_hash_table_remove(manager->messages, GUINT_TO_POINTER(window));
+
+        /* free the message */
+        systray_manager_message_free(manager, message);
+    }
+}
 
-        /* check if this is the same message */
-        if (xevent->window == message->window && xevent->data.l[4] == message->id) {
-            /* delete the message from the list */
-            manager->messages = g_slist_delete_link(manager->messages, li);
 
-            /* free the message */
-            systray_manager_message_free(message);
+static gboolean
+systray_manager_message_remove_all_func(gpointer key, gpointer value, gpointer user_data) {
+    systray_manager_message_free(SYSTRAY_MANAGER(user_data), value);
 
-            break;
-        }
+    return TRUE;
+}
+
+
+static void
+systray_manager_message_remove_all(SystrayManager *manager) {
+    g_hash_table_foreach_remove(manager->messages,
+                                systray_manager_message_remove_all_func, manager);
+
+    if (manager->message_timeout_id != 0) {
+        g_source_remove(manager->message_timeout_id);
+        manager->message_timeout_id = 0;
     }
 }
 
+
+gint64
+systray_manager_get_registered_time(SystrayManager *manager) {
+    g_return_val_if_fail(IS_SYSTRAY_MANAGER(manager), 0);
+
+    return manager->registered_time;
+}
+
+
+void
+systray_manager_get_stats(SystrayManager *manager, SystrayManagerStats *stats) {
+    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
+    g_return_if_fail(stats != NULL);
+
+    *stats = manager->stats;
+
+    /* the pipelined requests are counted per display */
+    if (manager->invisible != NULL) {
+        stats->n_async_requests = systray_async_get_n_requests(
+            gtk_widget_get_display(manager->invisible));
+    }
+}
+
+
+void
+systray_manager_reset_dock_stats(SystrayManager *manager) {
+    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
+
+    manager->stats.n_dock_batches = 0;
+    manager->stats.dock_time_total = 0;
+    manager->stats.dock_time_max = 0;
+}
@@ -28,6 +28,7 @@
 typedef struct _SystrayManagerClass SystrayManagerClass;
 typedef struct _SystrayManager SystrayManager;
 typedef struct _SystrayMessage SystrayMessage;
+typedef struct _SystrayManagerStats SystrayManagerStats;
 
 #define TYPE_SYSTRAY_MANAGER (systray_manager_get_type())
 #define SYSTRAY_MANAGER(obj) \
@@ -44,12 +45,51 @@ typedef struct _SystrayMessage SystrayMessage;
                                SystrayManagerClass))
 #define SYSTRAY_MANAGER_ERROR (systray_manager_error_quark())
 
+#define TYPE_SYSTRAY_MANAGER_STATS (systray_manager_stats_get_type())
+
 enum { SYSTRAY_MANAGER_ERROR_SELECTION_FAILED };
 
+/* counters of the manager since it was created */
+struct _SystrayManagerStats {
+    /* icons docked and undocked, and dock requests that didn't result
+     * in an icon */
+    guint64 n_docks;
+    guint64 n_undocks;
+    guint64 n_dock_failures;
+
+    /* balloon message data received, and pending messages that were
+     * cancelled */
+    guint64 n_message_chunks;
+    guint64 n_message_bytes;
+    guint64 n_messages_cancelled;
+
+    /* events that went through the client message filter */
+    guint64 n_events_seen;
+    guint64 n_events_handled;
+
+    /* times the manager blocked waiting for a reply from the server */
+    guint64 n_round_trips;
+
+    /* requests whose replies are handled from the main loop without
+     * blocking, including those of the icons while registered */
+    guint64 n_async_requests;
+
+    /* docks waiting for their socket now, and the most there ever were */
+    guint64 dock_queue_depth;
+    guint64 dock_queue_depth_max;
+
+    /* runs of the dock scheduler and the time they took, in microseconds */
+    guint64 n_dock_batches;
+    guint64 dock_time_total;
+    guint64 dock_time_max;
+};
+
 GType systray_manager_get_type(void) G_GNUC_CONST;
 
 GQuark systray_manager_error_quark(void);
 
+GType systray_manager_stats_get_type(void) G_GNUC_CONST;
+
 SystrayManager *systray_manager_new(void) G_GNUC_MALLOC;
 
 #if 0
@@ -64,4 +104,15 @@ void systray_manager_unregister(SystrayManager *manager);
 void systray_manager_set_orientation(SystrayManager *manager,
                                      GtkOrientation orientation);
 
+void systray_manager_update_visual(SystrayManager *manager);
+
+void systray_manager_get_event_counts(SystrayManager *manager,
+                                      guint64 *n_seen, guint64 *n_handled);
+
+gint64 systray_manager_get_registered_time(SystrayManager *manager);
+
+void systray_manager_get_stats(SystrayManager *manager, SystrayManagerStats *stats);
+
+void systray_manager_reset_dock_stats(SystrayManager *manager);
+
 #endif /* !__SYSTRAY_MANAGER_H__ */
@@ -23,14 +23,31 @@
 
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
 
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
 #include <gtk/gtkx.h>
 
+#include "systray-async.h"
+#include "systray-atoms.h"
 #include "systray-socket.h"
 
+/* maximum length of the properties we read, in 32 bit units */
+#define SYSTRAY_SOCKET_PROPERTY_LENGTH (1024)
+
+
+enum {
+    NAME_CHANGED,
+    WM_CLASS_CHANGED,
+    SNAPSHOT_CHANGED,
+    REQUEST_CHANGED,
+    LAST_SIGNAL
+};
+
 
 struct _SystraySocketClass {
     GtkSocketClass __parent__;
@@ -43,11 +60,57 @@ struct _SystraySocket {
     /* plug window */
     Window window;
 
+    /* gdk window of the plug while it is embedded */
+    GdkWindow *plug_window;
+
+    /* properties of the plug window, fetched asynchronously */
     gchar *name;
+    gchar *wm_class;
+    guint32 xembed_version;
+    guint32 xembed_flags;
+
+    SystraySocketStats stats;
+
+    /* repaints of a composited icon let through per second, 0 for no
+     * limit. damage arriving earlier is held back and merged */
+    guint max_fps;
+    gint64 last_repaint;
+    XDamageNotifyEvent held_damage;
+    guint release_id;
+    guint damage_held : 1;
+    guint damage_releasing : 1;
+
+    /* the tray can't be seen, hold back damage and redraws until it can */
+    guint suspended : 1;
+    guint redraw_pending : 1;
 
     guint is_composited : 1;
     guint parent_relative_bg : 1;
     guint hidden : 1;
+    guint name_from_net_wm : 1;
+    guint has_xembed_info : 1;
+    guint redraw_queued : 1;
+
+    /* gtk_socket_add_id has been called, and the name fetch is complete */
+    guint embedded : 1;
+    guint name_known : 1;
+
+    /* the manager left embedding it to the user of the socket, until then
+     * the client's events come through the per-display watch filter */
+    guint watched : 1;
+    guint watching : 1;
+
+    /* not shown in the tray, the window is redirected so its content can
+     * still be copied into the snapshot. it is outdated after damage */
+    guint offscreen : 1;
+    guint snapshot_dirty : 1;
+    cairo_surface_t *snapshot;
+    gint snapshot_width;
+    gint snapshot_height;
+
+    /* last known image of an icon that has not docked again yet. such a
+     * socket has no client and is never embedded */
+    cairo_surface_t *placeholder;
 };
 
 
@@ -55,19 +118,70 @@ static void systray_socket_finalize(GObject *object);
 
 static void systray_socket_realize(GtkWidget *widget);
 
+static void systray_socket_unrealize(GtkWidget *widget);
+
+static GdkFilterReturn systray_socket_damage_filter(GdkXEvent *xev, GdkEvent *event,
+        gpointer user_data);
+
+static void systray_socket_get_preferred_width(GtkWidget *widget, gint *minimum,
+        gint *natural);
+
+static void systray_socket_get_preferred_height(GtkWidget *widget, gint *minimum,
+        gint *natural);
+
 static void systray_socket_size_allocate(GtkWidget *widget, GtkAllocation *allocation);
 
 static gboolean systray_socket_expose_event(GtkWidget *widget, cairo_t *cr);
 
 static void systray_socket_style_set(GtkWidget *widget, GtkStyle *previous_style);
 
+static void systray_socket_plug_added(GtkSocket *gtk_socket);
+
+static void systray_socket_size_request_notify(GObject *object, GParamSpec *pspec,
+        gpointer user_data);
+
+static GdkFilterReturn systray_socket_plug_filter(GdkXEvent *xev, GdkEvent *event,
+        gpointer user_data);
+
+static gboolean systray_socket_plug_removed(GtkSocket *gtk_socket);
+
+static void systray_socket_client_gone(SystraySocket *socket);
+
+static GQuark systray_socket_watch_quark(void);
+
+static void systray_socket_fetch_name(SystraySocket *socket, GdkDisplay *display);
+
+static void systray_socket_fetch_wm_class(SystraySocket *socket, GdkDisplay *display);
+
+static void systray_socket_fetch_xembed_info(SystraySocket *socket, GdkDisplay *display);
+
+
+static guint systray_socket_signals[LAST_SIGNAL];
+
 
 G_DEFINE_TYPE(SystraySocket, systray_socket, GTK_TYPE_SOCKET)
 
 
+static SystraySocketStats *
+systray_socket_stats_copy(const SystraySocketStats *stats) {
+    return g_slice_dup(SystraySocketStats, stats);
+}
+
+
+static void
+systray_socket_stats_free(SystraySocketStats *stats) {
+    g_slice_free(SystraySocketStats, stats);
+}
+
+
+G_DEFINE_BOXED_TYPE(SystraySocketStats, systray_socket_stats, systray_socket_stats_copy,
+                    systray_socket_stats_free)
+
+
 static void
 systray_socket_class_init(SystraySocketClass *klass) {
     GtkWidgetClass *gtkwidget_class;
+    GtkSocketClass *gtksocket_class;
     GObjectClass *gobject_class;
 
     gobject_class = G_OBJECT_CLASS(klass);
@@ -75,9 +189,38 @@ systray_socket_class_init(SystraySocketClass *klass) {
 
     gtkwidget_class = GTK_WIDGET_CLASS(klass);
     gtkwidget_class->realize = systray_socket_realize;
+    gtkwidget_class->unrealize = systray_socket_unrealize;
+    gtkwidget_class->get_preferred_width = systray_socket_get_preferred_width;
+    gtkwidget_class->get_preferred_height = systray_socket_get_preferred_height;
     gtkwidget_class->size_allocate = systray_socket_size_allocate;
     gtkwidget_class->draw = systray_socket_expose_event;
     gtkwidget_class->style_set = systray_socket_style_set;
+
+    gtksocket_class = GTK_SOCKET_CLASS(klass);
+    gtksocket_class->plug_added = systray_socket_plug_added;
+    gtksocket_class->plug_removed = systray_socket_plug_removed;
+
+    systray_socket_signals[NAME_CHANGED] = g_signal_new(
+        g_intern_static_string("name-changed"), G_OBJECT_CLASS_TYPE(klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
+    systray_socket_signals[WM_CLASS_CHANGED] = g_signal_new(
+        g_intern_static_string("wm-class-changed"), G_OBJECT_CLASS_TYPE(klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
+    systray_socket_signals[SNAPSHOT_CHANGED] = g_signal_new(
+        g_intern_static_string("snapshot-changed"), G_OBJECT_CLASS_TYPE(klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
+    /* gtk doesn't tell containers which child queued a resize, this is
+     * emitted whenever the size request of the socket might change */
+    systray_socket_signals[REQUEST_CHANGED] = g_signal_new(
+        g_intern_static_string("request-changed"), G_OBJECT_CLASS_TYPE(klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
 }
 
 
@@ -85,6 +228,67 @@ static void
 systray_socket_init(SystraySocket *socket) {
     socket->hidden = FALSE;
     socket->name = NULL;
+    socket->wm_class = NULL;
+    socket->plug_window = NULL;
+    socket->name_from_net_wm = FALSE;
+    socket->has_xembed_info = FALSE;
+    socket->redraw_queued = FALSE;
+    socket->embedded = FALSE;
+    socket->name_known = FALSE;
+    socket->watched = FALSE;
+    socket->watching = FALSE;
+    socket->offscreen = FALSE;
+    socket->snapshot_dirty = TRUE;
+    socket->snapshot = NULL;
+    socket->snapshot_width = 0;
+    socket->snapshot_height = 0;
+    socket->placeholder = NULL;
+    memset(&socket->stats, 0, sizeof(socket->stats));
+    socket->max_fps = 0;
+    socket->last_repaint = 0;
+    socket->release_id = 0;
+    socket->damage_held = FALSE;
+    socket->damage_releasing = FALSE;
+    socket->suspended = FALSE;
+    socket->redraw_pending = FALSE;
+
+    g_signal_connect(G_OBJECT(socket), "notify::width-request",
+                     G_CALLBACK(systray_socket_size_request_notify), NULL);
+    g_signal_connect(G_OBJECT(socket), "notify::height-request",
+                     G_CALLBACK(systray_socket_size_request_notify), NULL);
+}
+
+
+static void
+systray_socket_unwatch_plug(SystraySocket *socket) {
+    GHashTable *watched;
+
+    if (socket->watching) {
+        watched = g_object_get_qdata(
+            G_OBJECT(gtk_widget_get_display(GTK_WIDGET(socket))),
+            systray_socket_watch_quark());
+        if (watched != NULL) {
+            g_hash_table_remove(watched, GUINT_TO_POINTER(socket->window));
+        }
+        socket->watching = FALSE;
+    }
+
+    if (socket->plug_window != NULL) {
+        gdk_window_remove_filter(socket->plug_window, systray_socket_plug_filter,
+                                 socket);
+        g_object_unref(G_OBJECT(socket->plug_window));
+        socket->plug_window = NULL;
+    }
+}
+
+
+static void
+systray_socket_drop_snapshot(SystraySocket *socket) {
+    if (socket->snapshot != NULL) {
+        cairo_surface_destroy(socket->snapshot);
+        socket->snapshot = NULL;
+    }
+    socket->snapshot_dirty = TRUE;
 }
 
 
@@ -92,47 +296,68 @@ static void
 systray_socket_finalize(GObject *object) {
     SystraySocket *socket = SYSTRAY_SOCKET(object);
 
+    systray_socket_unwatch_plug(socket);
+    systray_socket_drop_snapshot(socket);
+
+    if (socket->placeholder != NULL) {
+        cairo_surface_destroy(socket->placeholder);
+    }
+
+    /* drop the replies of property requests still in flight */
+    systray_async_cancel(gtk_widget_get_display(GTK_WIDGET(socket)), socket);
+
     g_free(socket->name);
+    g_free(socket->wm_class);
 
     G_OBJECT_CLASS(systray_socket_parent_class)->finalize(object);
 }
 
 
 static void
-systray_socket_realize(GtkWidget *widget) {
-    SystraySocket *socket = SYSTRAY_SOCKET(widget);
+systray_socket_apply_composited(SystraySocket *socket) {
+    GtkWidget *widget = GTK_WIDGET(socket);
     GdkColor transparent = {0, 0, 0, 0};
     GdkWindow *window;
 
-    GTK_WIDGET_CLASS(systray_socket_parent_class)->realize(widget);
-
     window = gtk_widget_get_window(widget);
 
+    socket->parent_relative_bg = FALSE;
     if (socket->is_composited) {
         gdk_window_set_background(window, &transparent);
-        gdk_window_set_composited(window, TRUE);
-
-        socket->parent_relative_bg = FALSE;
-    }
-    /* No gtk_window_set_back_pixmap in Gtk3
-    else if (gtk_widget_get_visual (widget) ==
-             gdk_window_get_visual (gdk_window_get_parent (window)))
-      {
-        gdk_window_set_back_pixmap (window, NULL, TRUE);
-
+    } else if (gtk_widget_get_visual(widget) ==
+               gdk_window_get_visual(gdk_window_get_parent(window))) {
+        /* without a pattern, gdk uses a ParentRelative background. the
+         * client is sent an expose whenever the icon moves, so it can
+         * paint itself over the new background */
+        gdk_window_set_background_pattern(window, NULL);
         socket->parent_relative_bg = TRUE;
-      }
-  */
-    else {
-        socket->parent_relative_bg = FALSE;
     }
 
-    gdk_window_set_composited(window, socket->is_composited);
+    /* offscreen icons are redirected too, but nothing paints them into the
+     * tray. that keeps their content for the snapshot, as far as the
+     * server can redirect at all */
+    gdk_window_set_composited(window, socket->is_composited ||
+        (socket->offscreen &&
+         gdk_display_supports_composite(gdk_window_get_display(window))));
 
     gtk_widget_set_app_paintable(
         widget, socket->parent_relative_bg || socket->is_composited);
 
     gtk_widget_set_double_buffered(widget, socket->parent_relative_bg);
+}
+
+
+static void
+systray_socket_realize(GtkWidget *widget) {
+    SystraySocket *socket = SYSTRAY_SOCKET(widget);
+
+    GTK_WIDGET_CLASS(systray_socket_parent_class)->realize(widget);
+
+    systray_socket_apply_composited(socket);
+
+    /* gdk tracks the damage of composited sockets, we only look at it */
+    gdk_window_add_filter(gtk_widget_get_window(widget), systray_socket_damage_filter,
+                          socket);
 
     g_debug("socket %s[%p] (composited=%s, relative-bg=%s",
             systray_socket_get_name(socket), socket,
@@ -141,6 +366,181 @@ systray_socket_realize(GtkWidget *widget) {
 }
 
 
+static void
+systray_socket_unrealize(GtkWidget *widget) {
+    SystraySocket *socket = SYSTRAY_SOCKET(widget);
+
+    gdk_window_remove_filter(gtk_widget_get_window(widget), systray_socket_damage_filter,
+                             socket);
+
+    /* held back damage is meaningless without the window */
+    if (socket->release_id != 0) {
+        g_source_remove(socket->release_id);
+        socket->release_id = 0;
+    }
+    socket->damage_held = FALSE;
+
+    systray_socket_drop_snapshot(socket);
+
+    GTK_WIDGET_CLASS(systray_socket_parent_class)->unrealize(widget);
+}
+
+
+static GQuark
+systray_socket_watch_quark(void) {
+    static GQuark q = 0;
+
+    if (q == 0) {
+        q = g_quark_from_static_string("systray-socket-watch");
+    }
+
+    return q;
+}
+
+
+static GQuark
+systray_socket_damage_quark(void) {
+    static GQuark q = 0;
+
+    if (q == 0) {
+        q = g_quark_from_static_string("systray-socket-damage");
+    }
+
+    return q;
+}
+
+
+static gint
+systray_socket_damage_event(GdkDisplay *display) {
+    gpointer p;
+    gint event_base, error_base;
+
+    /* stored plus one, zero means not queried yet */
+    p = g_object_get_qdata(G_OBJECT(display), systray_socket_damage_quark());
+    if (G_UNLIKELY(p == NULL)) {
+        if (XDamageQueryExtension(GDK_DISPLAY_XDISPLAY(display), &event_base,
+                                  &error_base)) {
+            p = GINT_TO_POINTER(event_base + XDamageNotify + 1);
+        } else {
+            /* no event type is negative */
+            p = GINT_TO_POINTER(-1);
+        }
+        g_object_set_qdata(G_OBJECT(display), systray_socket_damage_quark(), p);
+    }
+
+    return GPOINTER_TO_INT(p) - 1;
+}
+
+
+static gboolean
+systray_socket_release_damage(gpointer user_data) {
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    GdkDisplay *display = gtk_widget_get_display(GTK_WIDGET(socket));
+
+    socket->release_id = 0;
+
+    if (socket->damage_held && !socket->suspended) {
+        /* gdk processes it now, repairs the damage and invalidates the
+         * icon, which lets the next damage notify through */
+        socket->damage_held = FALSE;
+        socket->damage_releasing = TRUE;
+        XPutBackEvent(GDK_DISPLAY_XDISPLAY(display), (XEvent *)&socket->held_damage);
+    }
+
+    return FALSE;
+}
+
+
+static GdkFilterReturn
+systray_socket_damage_filter(GdkXEvent *xev, GdkEvent *event, gpointer user_data) {
+    XDamageNotifyEvent *damage = (XDamageNotifyEvent *)xev;
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    XRectangle *held;
+    gint64 now, interval;
+    gint x2, y2;
+
+    if (G_LIKELY(damage->type !=
+                 systray_socket_damage_event(gtk_widget_get_display(GTK_WIDGET(socket))))) {
+        return GDK_FILTER_CONTINUE;
+    }
+
+    /* the next look into the drawer takes a new snapshot */
+    if (socket->offscreen && !socket->snapshot_dirty) {
+        socket->snapshot_dirty = TRUE;
+        g_signal_emit(socket, systray_socket_signals[SNAPSHOT_CHANGED], 0);
+    }
+
+    now = g_get_monotonic_time();
+
+    if (socket->damage_releasing) {
+        /* our own held back event coming through */
+        socket->damage_releasing = FALSE;
+        socket->last_repaint = now;
+        return GDK_FILTER_CONTINUE;
+    }
+
+    socket->stats.n_damages++;
+
+    interval = socket->max_fps > 0 ? G_USEC_PER_SEC / socket->max_fps : 0;
+    if (!socket->damage_held && !socket->suspended &&
+        now - socket->last_repaint >= interval) {
+        socket->last_repaint = now;
+        return GDK_FILTER_CONTINUE;
+    }
+
+    /* too early, merge it with what is held back until the interval ends */
+    socket->stats.n_damages_coalesced++;
+
+    if (socket->damage_held) {
+        held = &socket->held_damage.area;
+        x2 = MAX(held->x + held->width, damage->area.x + damage->area.width);
+        y2 = MAX(held->y + held->height, damage->area.y + damage->area.height);
+        held->x = MIN(held->x, damage->area.x);
+        held->y = MIN(held->y, damage->area.y);
+        held->width = x2 - held->x;
+        held->height = y2 - held->y;
+    } else {
+        socket->held_damage = *damage;
+        socket->damage_held = TRUE;
+
+        /* while suspended, it waits for systray_socket_set_suspended */
+        if (!socket->suspended) {
+            socket->release_id = g_timeout_add(
+                (socket->last_repaint + interval - now + 999) / 1000,
+                systray_socket_release_damage, socket);
+        }
+    }
+
+    return GDK_FILTER_REMOVE;
+}
+
+
+static void
+systray_socket_get_preferred_width(GtkWidget *widget, gint *minimum, gint *natural) {
+    SystraySocket *socket = SYSTRAY_SOCKET(widget);
+
+    if (socket->placeholder != NULL) {
+        *minimum = *natural = cairo_image_surface_get_width(socket->placeholder);
+    } else {
+        GTK_WIDGET_CLASS(systray_socket_parent_class)
+            ->get_preferred_width(widget, minimum, natural);
+    }
+}
+
+
+static void
+systray_socket_get_preferred_height(GtkWidget *widget, gint *minimum, gint *natural) {
+    SystraySocket *socket = SYSTRAY_SOCKET(widget);
+
+    if (socket->placeholder != NULL) {
+        *minimum = *natural = cairo_image_surface_get_height(socket->placeholder);
+    } else {
+        GTK_WIDGET_CLASS(systray_socket_parent_class)
+            ->get_preferred_height(widget, minimum, natural);
+    }
+}
+
+
 static void
 systray_socket_size_allocate(GtkWidget *widget,
                                          GtkAllocation *allocation) {
@@ -178,6 +578,20 @@ systray_socket_size_allocate(GtkWidget *widget,
 
 static gboolean
 systray_socket_expose_event(GtkWidget *widget, cairo_t *cr) {
+    SystraySocket *socket = SYSTRAY_SOCKET(widget);
+
+    /* there is no client to draw, show the cached image instead */
+    if (socket->placeholder != NULL) {
+        cairo_set_source_surface(
+            cr, socket->placeholder,
+            (gtk_widget_get_allocated_width(widget) -
+             cairo_image_surface_get_width(socket->placeholder)) / 2,
+            (gtk_widget_get_allocated_height(widget) -
+             cairo_image_surface_get_height(socket->placeholder)) / 2);
+        cairo_paint(cr);
+        return FALSE;
+    }
+
     cairo_set_source_rgba(cr, 0, 0, 0, 0);
     cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
     cairo_fill(cr);
@@ -191,71 +605,298 @@ systray_socket_style_set(GtkWidget *widget, GtkStyle *previous_style) {
 }
 
 
+static void
+systray_socket_plug_added(GtkSocket *gtk_socket) {
+    SystraySocket *socket = SYSTRAY_SOCKET(gtk_socket);
+    GdkWindow *plug_window;
+
+    if (GTK_SOCKET_CLASS(systray_socket_parent_class)->plug_added != NULL) {
+        GTK_SOCKET_CLASS(systray_socket_parent_class)->plug_added(gtk_socket);
+    }
+
+    /* gtk selects property changes on the plug window, so we can keep the
+     * cached properties up to date by listening to them */
+    plug_window = gtk_socket_get_plug_window(gtk_socket);
+    if (plug_window != NULL && socket->plug_window == NULL) {
+        systray_socket_unwatch_plug(socket);
+        socket->plug_window = g_object_ref(G_OBJECT(plug_window));
+        gdk_window_add_filter(socket->plug_window, systray_socket_plug_filter,
+                              socket);
+    }
+
+    /* the size is the one of the plug from now on */
+    g_signal_emit(socket, systray_socket_signals[REQUEST_CHANGED], 0);
+}
+
+
+static void
+systray_socket_size_request_notify(GObject *object, GParamSpec *pspec,
+        gpointer user_data) {
+    /* a size set with gtk_widget_set_size_request */
+    g_signal_emit(object, systray_socket_signals[REQUEST_CHANGED], 0);
+}
+
+
+static gboolean
+systray_socket_plug_removed(GtkSocket *gtk_socket) {
+    systray_socket_unwatch_plug(SYSTRAY_SOCKET(gtk_socket));
+
+    /* let the default handling destroy the socket */
+    return FALSE;
+}
+
+
+static void
+systray_socket_client_gone(SystraySocket *socket) {
+    gboolean handled = FALSE;
+
+    systray_socket_unwatch_plug(socket);
+
+    /* end it like gtk ends an embedding, so undocking works the same */
+    g_object_ref(G_OBJECT(socket));
+    g_signal_emit_by_name(socket, "plug-removed", &handled);
+    if (!handled) {
+        gtk_widget_destroy(GTK_WIDGET(socket));
+    }
+    g_object_unref(G_OBJECT(socket));
+}
+
+
+static GdkFilterReturn
+systray_socket_plug_filter(GdkXEvent *xev, GdkEvent *event, gpointer user_data) {
+    XEvent *xevent = (XEvent *)xev;
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    GdkDisplay *display;
+    const Atom *atoms;
+    Atom atom;
+
+    if (xevent->xany.window != socket->window) {
+        return GDK_FILTER_CONTINUE;
+    }
+
+    /* gtk only notices a client going away once it is embedded */
+    if (xevent->type == DestroyNotify && !socket->embedded &&
+        xevent->xdestroywindow.window == socket->window) {
+        systray_socket_client_gone(socket);
+        return GDK_FILTER_CONTINUE;
+    }
+
+    if (G_LIKELY(xevent->type != PropertyNotify)) {
+        return GDK_FILTER_CONTINUE;
+    }
+
+    /* gtk reads the size hints again on the next size request */
+    if (xevent->xproperty.atom == XA_WM_NORMAL_HINTS) {
+        g_signal_emit(socket, systray_socket_signals[REQUEST_CHANGED], 0);
+        return GDK_FILTER_CONTINUE;
+    }
+
+    display = gtk_widget_get_display(GTK_WIDGET(socket));
+    atoms = systray_atoms_get(display);
+    atom = xevent->xproperty.atom;
+
+    /* refetch the property that changed */
+    if (atom == atoms[SYSTRAY_ATOM_NET_WM_NAME] || atom == atoms[SYSTRAY_ATOM_WM_NAME]) {
+        systray_socket_fetch_name(socket, display);
+    } else if (atom == atoms[SYSTRAY_ATOM_WM_CLASS]) {
+        systray_socket_fetch_wm_class(socket, display);
+    } else if (atom == atoms[SYSTRAY_ATOM_XEMBED_INFO]) {
+        systray_socket_fetch_xembed_info(socket, display);
+    } else {
+        return GDK_FILTER_CONTINUE;
+    }
+
+    systray_async_flush(display);
+
+    /* gtk wants to see property changes too */
+    return GDK_FILTER_CONTINUE;
+}
+
+
+static gboolean
+systray_socket_visual_is_composited(GdkDisplay *display, GdkVisual *visual) {
+    gint red_prec, green_prec, blue_prec;
+
+    if (!gdk_display_supports_composite(display)) {
+        return FALSE;
+    }
+
+    /* only icons with an alpha channel are painted by the tray, like in
+     * xfce4-panel. opaque icons draw themselves over a parent-relative
+     * background, redirecting them would cost a damage round and a render
+     * blit per repaint for the same pixels. neither the visual nor the
+     * extension change at runtime, so this is decided once per socket */
+    gdk_visual_get_red_pixel_details(visual, NULL, NULL, &red_prec);
+    gdk_visual_get_green_pixel_details(visual, NULL, NULL, &green_prec);
+    gdk_visual_get_blue_pixel_details(visual, NULL, NULL, &blue_prec);
+
+    return red_prec + green_prec + blue_prec < gdk_visual_get_depth(visual);
+}
+
+
 GtkWidget *
-systray_socket_new(GdkScreen *screen, Window window) {
+systray_socket_new(GdkScreen *screen, Window window, GdkVisual *visual) {
     SystraySocket *socket;
     GdkDisplay *display;
-    XWindowAttributes attr;
-    gint result;
-    GdkVisual *visual;
 
     g_return_val_if_fail(GDK_IS_SCREEN(screen), NULL);
+    g_return_val_if_fail(GDK_IS_VISUAL(visual), NULL);
 
-    /* get the window attributes */
     display = gdk_screen_get_display(screen);
-    gdk_error_trap_push();
-    result = XGetWindowAttributes(GDK_DISPLAY_XDISPLAY(display), window, &attr);
-
-    /* leave on an error or if the window does not exist */
-    if (gdk_error_trap_pop() != 0 || result == 0) return NULL;
-
-    /* get the windows visual */
-    visual = gdk_x11_screen_lookup_visual(screen, attr.visual->visualid);
-    g_return_val_if_fail(visual == NULL || GDK_IS_VISUAL(visual), NULL);
-    if (G_UNLIKELY(visual == NULL)) return NULL;
 
     /* create a new socket */
     socket = g_object_new(TYPE_SYSTRAY_SOCKET, NULL);
     socket->window = window;
-    socket->is_composited = TRUE;
+    socket->is_composited = systray_socket_visual_is_composited(display, visual);
     gtk_widget_set_visual(GTK_WIDGET(socket), visual);
 
+    /* request the properties we sort and hide by right away, the replies
+     * come in while the icon gets embedded */
+    systray_socket_fetch_name(socket, display);
+    systray_socket_fetch_wm_class(socket, display);
+    systray_socket_fetch_xembed_info(socket, display);
+    systray_async_flush(display);
+
+    return GTK_WIDGET(socket);
+}
+
+
+GtkWidget *
+systray_socket_new_placeholder(const gchar *name, cairo_surface_t *surface) {
+    SystraySocket *socket;
+
+    g_return_val_if_fail(name != NULL, NULL);
+    g_return_val_if_fail(surface != NULL, NULL);
+
+    /* sorted and hidden by the name like the icon it stands in for */
+    socket = g_object_new(TYPE_SYSTRAY_SOCKET, NULL);
+    socket->window = None;
+    socket->name = g_strdup(name);
+    socket->name_known = TRUE;
+    socket->placeholder = cairo_surface_reference(surface);
+
     return GTK_WIDGET(socket);
 }
 
 
+static void
+systray_socket_send_expose(SystraySocket *socket) {
+    GtkWidget *widget = GTK_WIDGET(socket);
+    GtkAllocation allocation;
+    GdkWindow *plug_window;
+    XEvent xev;
+
+    /* the socket might have changed since the expose was queued */
+    plug_window = gtk_socket_get_plug_window(GTK_SOCKET(socket));
+    if (!gtk_widget_get_mapped(widget) || plug_window == NULL) {
+        return;
+    }
+
+    gtk_widget_get_allocation(widget, &allocation);
+
+    xev.xexpose.type = Expose;
+    xev.xexpose.window = GDK_WINDOW_XID(plug_window);
+    xev.xexpose.x = 0;
+    xev.xexpose.y = 0;
+    xev.xexpose.width = allocation.width;
+    xev.xexpose.height = allocation.height;
+    xev.xexpose.count = 0;
+
+    XSendEvent(GDK_DISPLAY_XDISPLAY(gtk_widget_get_display(widget)),
+               xev.xexpose.window, False, ExposureMask, &xev);
+
+    socket->stats.n_exposes++;
+}
+
+
+static GQuark
+systray_socket_redraw_quark(void) {
+    static GQuark q = 0;
+
+    if (q == 0) {
+        q = g_quark_from_static_string("systray-socket-redraw");
+    }
+
+    return q;
+}
+
+
+static void
+systray_socket_redraw_after_paint(GdkFrameClock *clock, GdkDisplay *display) {
+    GPtrArray *queue;
+    SystraySocket *socket;
+    guint i;
+
+    queue = g_object_get_qdata(G_OBJECT(clock), systray_socket_redraw_quark());
+    if (queue == NULL || queue->len == 0) {
+        return;
+    }
+
+    /* send all exposes of this frame at once. errors from clients that
+     * went away in the meantime are ignored without a round trip */
+    gdk_error_trap_push();
+    for (i = 0; i < queue->len; i++) {
+        socket = g_ptr_array_index(queue, i);
+        socket->redraw_queued = FALSE;
+        systray_socket_send_expose(socket);
+    }
+    gdk_error_trap_pop_ignored();
+
+    gdk_display_flush(display);
+
+    /* drops the references */
+    g_ptr_array_set_size(queue, 0);
+}
+
+
 void
 systray_socket_force_redraw(SystraySocket *socket) {
     GtkWidget *widget = GTK_WIDGET(socket);
-    XEvent xev;
-    GdkDisplay *display;
+    GdkFrameClock *clock;
+    GPtrArray *queue;
 
     g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
 
-    if (gtk_widget_get_mapped(GTK_WIDGET(socket)) && socket->parent_relative_bg) {
-        display = gtk_widget_get_display(widget);
+    if (!gtk_widget_get_mapped(widget) || !socket->parent_relative_bg) {
+        return;
+    }
 
-        GtkAllocation allocation;
-        gtk_widget_get_allocation(widget, &allocation);
+    /* already goes out with the next frame */
+    if (socket->redraw_queued) {
+        socket->stats.n_exposes_merged++;
+        return;
+    }
 
-        xev.xexpose.type = Expose;
-        xev.xexpose.window =
-            GDK_WINDOW_XID(gtk_socket_get_plug_window(GTK_SOCKET(socket)));
-        xev.xexpose.x = 0;
-        xev.xexpose.y = 0;
-        xev.xexpose.width = allocation.width;
-        xev.xexpose.height = allocation.height;
-        xev.xexpose.count = 0;
+    /* nobody would see it, redraw once the tray is visible again */
+    if (socket->suspended) {
+        socket->redraw_pending = TRUE;
+        return;
+    }
 
+    clock = gtk_widget_get_frame_clock(widget);
+    if (G_UNLIKELY(clock == NULL)) {
         gdk_error_trap_push();
-        XSendEvent(GDK_DISPLAY_XDISPLAY(display), xev.xexpose.window, False,
-                   ExposureMask, &xev);
-        /* We have to sync to reliably catch errors from the XSendEvent(),
-         * since that is asynchronous.
-         */
-        XSync(GDK_DISPLAY_XDISPLAY(display), False);
-        (void)gdk_error_trap_pop();
+        systray_socket_send_expose(socket);
+        gdk_error_trap_pop_ignored();
+        return;
+    }
+
+    /* queue the expose on the frame clock of the toplevel, so a relayout
+     * of many icons is sent out in a single batch after painting */
+    queue = g_object_get_qdata(G_OBJECT(clock), systray_socket_redraw_quark());
+    if (queue == NULL) {
+        queue = g_ptr_array_new_with_free_func(g_object_unref);
+        g_object_set_qdata_full(G_OBJECT(clock), systray_socket_redraw_quark(), queue,
+                                (GDestroyNotify)g_ptr_array_unref);
+        g_signal_connect(G_OBJECT(clock), "after-paint",
+                         G_CALLBACK(systray_socket_redraw_after_paint),
+                         gtk_widget_get_display(widget));
     }
+
+    g_ptr_array_add(queue, g_object_ref(G_OBJECT(socket)));
+    socket->redraw_queued = TRUE;
+
+    gdk_frame_clock_request_phase(clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
 }
 
 
@@ -266,45 +907,215 @@ systray_socket_is_composited(SystraySocket *socket) {
     return socket->is_composited;
 }
 
-static gchar *
-systray_socket_get_name_prop(SystraySocket *socket, const gchar *prop_name,
-        const gchar *type_name) {
-    GdkDisplay *display;
-    Atom req_type, type;
-    gint result;
-    gchar *val;
-    gint format;
-    gulong nitems;
-    gulong bytes_after;
-    gchar *name = NULL;
 
-    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), NULL);
-    g_return_val_if_fail(type_name != NULL && prop_name != NULL, NULL);
+void
+systray_socket_composite(SystraySocket *socket, cairo_t *cr) {
+    GtkAllocation alloc;
 
-    display = gtk_widget_get_display(GTK_WIDGET(socket));
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+    g_return_if_fail(socket->is_composited);
 
-    req_type = gdk_x11_get_xatom_by_name_for_display(display, type_name);
+    /* paint the redirected window at its place in the tray */
+    gtk_widget_get_allocation(GTK_WIDGET(socket), &alloc);
+    gdk_cairo_set_source_window(cr, gtk_widget_get_window(GTK_WIDGET(socket)),
+                                alloc.x, alloc.y);
+    cairo_paint(cr);
 
-    gdk_error_trap_push();
+    socket->stats.n_composites++;
+}
 
-    result = XGetWindowProperty(GDK_DISPLAY_XDISPLAY(display), socket->window,
-        gdk_x11_get_xatom_by_name_for_display(display, prop_name), 0, G_MAXLONG,
-        False, req_type, &type, &format, &nitems, &bytes_after, (guchar **)&val);
 
-    /* check if everything went fine */
-    if (gdk_error_trap_pop() != 0 || result != Success || val == NULL) {
+static gchar *
+systray_socket_reply_get_string(xcb_get_property_reply_t *reply, Atom req_type) {
+    const gchar *val;
+    gint length;
+
+    /* check the returned data */
+    if (reply == NULL || reply->type != req_type || reply->format != 8) {
         return NULL;
     }
 
-    /* check the returned data */
-    if (type == req_type && format == 8 && nitems > 0 && g_utf8_validate(val, nitems, NULL)) {
+    val = xcb_get_property_value(reply);
+    length = xcb_get_property_value_length(reply);
+
+    if (length > 0 && g_utf8_validate(val, length, NULL)) {
         /* lowercase the result */
-        name = g_utf8_strdown(val, nitems);
+        return g_utf8_strdown(val, length);
+    }
+
+    return NULL;
+}
+
+
+static void
+systray_socket_set_name(SystraySocket *socket, gchar *name) {
+    /* takes ownership of name */
+    if (g_strcmp0(socket->name, name) == 0) {
+        g_free(name);
+        return;
+    }
+
+    g_free(socket->name);
+    socket->name = name;
+
+    g_signal_emit(socket, systray_socket_signals[NAME_CHANGED], 0);
+}
+
+
+static void
+systray_socket_net_wm_name_reply(gpointer reply, xcb_generic_error_t *error,
+                                 gpointer user_data) {
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    const Atom *atoms;
+    gchar *name;
+
+    atoms = systray_atoms_get(gtk_widget_get_display(GTK_WIDGET(socket)));
+    name = systray_socket_reply_get_string(reply, atoms[SYSTRAY_ATOM_UTF8_STRING]);
+
+    /* _NET_WM_NAME is used by gtk icon implementations and has precedence,
+     * the WM_NAME reply that follows is only used without it */
+    socket->name_from_net_wm = (name != NULL);
+    if (name != NULL) {
+        systray_socket_set_name(socket, name);
     }
+}
+
 
-    XFree(val);
+static void
+systray_socket_wm_name_reply(gpointer reply, xcb_generic_error_t *error,
+                             gpointer user_data) {
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    const Atom *atoms;
+    gchar *name;
+    gboolean first = !socket->name_known;
+
+    /* this is the last reply of a name fetch */
+    socket->name_known = TRUE;
+
+    /* fall back to WM_NAME for qt icons */
+    if (!socket->name_from_net_wm) {
+        atoms = systray_atoms_get(gtk_widget_get_display(GTK_WIDGET(socket)));
+        name = systray_socket_reply_get_string(reply, atoms[SYSTRAY_ATOM_STRING]);
+        if (g_strcmp0(socket->name, name) != 0) {
+            systray_socket_set_name(socket, name);
+            return;
+        }
+        g_free(name);
+    }
 
-    return name;
+    /* tell about the name being known even if it didn't change */
+    if (first) {
+        g_signal_emit(socket, systray_socket_signals[NAME_CHANGED], 0);
+    }
+}
+
+
+static void
+systray_socket_wm_class_reply(gpointer reply, xcb_generic_error_t *error,
+                              gpointer user_data) {
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    xcb_get_property_reply_t *prop = reply;
+    const gchar *val;
+    gchar *wm_class = NULL;
+    gint length;
+    gsize name_length;
+
+    if (prop != NULL && prop->type == XA_STRING && prop->format == 8) {
+        /* the property holds the instance name and the class name, both
+         * nul-terminated, we're interested in the class */
+        val = xcb_get_property_value(prop);
+        length = xcb_get_property_value_length(prop);
+        name_length = strnlen(val, length);
+
+        if (name_length + 1 < (gsize)length) {
+            wm_class = g_strndup(val + name_length + 1, length - name_length - 1);
+        }
+    }
+
+    if (g_strcmp0(socket->wm_class, wm_class) == 0) {
+        g_free(wm_class);
+        return;
+    }
+
+    g_free(socket->wm_class);
+    socket->wm_class = wm_class;
+
+    /* the reply comes after the name, nameless icons are only known by it */
+    g_signal_emit(socket, systray_socket_signals[WM_CLASS_CHANGED], 0);
+}
+
+
+static void
+systray_socket_xembed_info_reply(gpointer reply, xcb_generic_error_t *error,
+                                 gpointer user_data) {
+    SystraySocket *socket = SYSTRAY_SOCKET(user_data);
+    xcb_get_property_reply_t *prop = reply;
+    const guint32 *val;
+
+    socket->has_xembed_info = FALSE;
+
+    /* selecting events on a window that is already gone fails silently,
+     * the reply to the request sent after it tells */
+    if (error != NULL && error->error_code == BadWindow && socket->watching) {
+        systray_socket_client_gone(socket);
+        return;
+    }
+
+    /* version and flags */
+    if (prop != NULL && prop->format == 32 &&
+        xcb_get_property_value_length(prop) >= 2 * 4) {
+        val = xcb_get_property_value(prop);
+        socket->xembed_version = val[0];
+        socket->xembed_flags = val[1];
+        socket->has_xembed_info = TRUE;
+    }
+}
+
+
+static void
+systray_socket_fetch_property(SystraySocket *socket, GdkDisplay *display,
+                              Atom property, Atom type, SystrayAsyncFunc func) {
+    xcb_get_property_cookie_t cookie;
+
+    /* send the request, the reply is handled from the main loop */
+    cookie = xcb_get_property(systray_async_get_connection(display), FALSE,
+                              socket->window, property, type, 0,
+                              SYSTRAY_SOCKET_PROPERTY_LENGTH);
+    systray_async_add(display, cookie.sequence, func, socket);
+}
+
+
+static void
+systray_socket_fetch_name(SystraySocket *socket, GdkDisplay *display) {
+    const Atom *atoms = systray_atoms_get(display);
+
+    /* ask for both names at once, the replies arrive in this order */
+    systray_socket_fetch_property(socket, display, atoms[SYSTRAY_ATOM_NET_WM_NAME],
+                                  atoms[SYSTRAY_ATOM_UTF8_STRING],
+                                  systray_socket_net_wm_name_reply);
+    systray_socket_fetch_property(socket, display, atoms[SYSTRAY_ATOM_WM_NAME],
+                                  atoms[SYSTRAY_ATOM_STRING],
+                                  systray_socket_wm_name_reply);
+}
+
+
+static void
+systray_socket_fetch_wm_class(SystraySocket *socket, GdkDisplay *display) {
+    const Atom *atoms = systray_atoms_get(display);
+
+    systray_socket_fetch_property(socket, display, atoms[SYSTRAY_ATOM_WM_CLASS],
+                                  atoms[SYSTRAY_ATOM_STRING],
+                                  systray_socket_wm_class_reply);
+}
+
+
+static void
+systray_socket_fetch_xembed_info(SystraySocket *socket, GdkDisplay *display) {
+    const Atom *atoms = systray_atoms_get(display);
+
+    systray_socket_fetch_property(socket, display, atoms[SYSTRAY_ATOM_XEMBED_INFO],
+                                  atoms[SYSTRAY_ATOM_XEMBED_INFO],
+                                  systray_socket_xembed_info_reply);
 }
 
 
@@ -312,18 +1123,37 @@ const gchar *
 systray_socket_get_name(SystraySocket *socket) {
     g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), NULL);
 
-    if (G_LIKELY(socket->name != NULL)) {
-        return socket->name;
+    /* NULL until the reply arrived, "name-changed" is emitted then */
+    return socket->name;
+}
+
+
+const gchar *
+systray_socket_get_wm_class(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), NULL);
+
+    return socket->wm_class;
+}
+
+
+gboolean
+systray_socket_get_xembed_info(SystraySocket *socket, guint32 *version,
+                               guint32 *flags) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    if (!socket->has_xembed_info) {
+        return FALSE;
     }
 
-    /* try _NET_WM_NAME first, for gtk icon implementations, fall back to
-     * WM_NAME for qt icons */
-    socket->name = systray_socket_get_name_prop(socket, "_NET_WM_NAME", "UTF8_STRING");
-    if (G_UNLIKELY(socket->name == NULL)) {
-        socket->name = systray_socket_get_name_prop(socket, "WM_NAME", "STRING");
+    if (version != NULL) {
+        *version = socket->xembed_version;
     }
 
-    return socket->name;
+    if (flags != NULL) {
+        *flags = socket->xembed_flags;
+    }
+
+    return TRUE;
 }
 
 
@@ -350,3 +1180,341 @@ systray_socket_set_hidden(SystraySocket *socket, gboolean hidden) {
     socket->hidden = hidden;
 }
 
+
+void
+systray_socket_set_offscreen(SystraySocket *socket, gboolean offscreen) {
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+
+    if (socket->offscreen == (guint)offscreen) {
+        return;
+    }
+
+    socket->offscreen = offscreen;
+    if (!offscreen) {
+        systray_socket_drop_snapshot(socket);
+    }
+
+    if (gtk_widget_get_realized(GTK_WIDGET(socket))) {
+        systray_socket_apply_composited(socket);
+    }
+}
+
+
+gboolean
+systray_socket_get_offscreen(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    return socket->offscreen;
+}
+
+
+cairo_surface_t *
+systray_socket_get_snapshot(SystraySocket *socket) {
+    GtkWidget *widget = GTK_WIDGET(socket);
+    GtkAllocation alloc;
+    GdkWindow *window;
+    cairo_t *cr;
+
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), NULL);
+
+    if (!socket->offscreen || !gtk_widget_get_realized(widget)) {
+        return NULL;
+    }
+
+    if (socket->snapshot != NULL && !socket->snapshot_dirty) {
+        return socket->snapshot;
+    }
+
+    window = gtk_widget_get_window(widget);
+    gtk_widget_get_allocation(widget, &alloc);
+    if (alloc.width < 1 || alloc.height < 1) {
+        return NULL;
+    }
+
+    /* a server side surface, so taking the snapshot is a render blit
+     * from the redirected window instead of an image roundtrip */
+    if (socket->snapshot != NULL && (socket->snapshot_width != alloc.width ||
+                                     socket->snapshot_height != alloc.height)) {
+        cairo_surface_destroy(socket->snapshot);
+        socket->snapshot = NULL;
+    }
+    if (socket->snapshot == NULL) {
+        socket->snapshot = gdk_window_create_similar_surface(
+            window, CAIRO_CONTENT_COLOR_ALPHA, alloc.width, alloc.height);
+        socket->snapshot_width = alloc.width;
+        socket->snapshot_height = alloc.height;
+    }
+
+    cr = cairo_create(socket->snapshot);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    gdk_cairo_set_source_window(cr, window, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    socket->snapshot_dirty = FALSE;
+    socket->stats.n_snapshots++;
+
+    return socket->snapshot;
+}
+
+
+cairo_surface_t *
+systray_socket_capture(SystraySocket *socket) {
+    GtkWidget *widget = GTK_WIDGET(socket);
+    cairo_surface_t *surface, *snapshot = NULL;
+    GtkAllocation alloc;
+    cairo_t *cr;
+
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), NULL);
+
+    if (!socket->embedded || !gtk_widget_get_realized(widget)) {
+        return NULL;
+    }
+
+    gtk_widget_get_allocation(widget, &alloc);
+    if (alloc.width < 1 || alloc.height < 1) {
+        return NULL;
+    }
+
+    /* offscreen icons are only readable through the redirected window */
+    if (socket->offscreen) {
+        snapshot = systray_socket_get_snapshot(socket);
+        if (snapshot == NULL) {
+            return NULL;
+        }
+    }
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, alloc.width, alloc.height);
+    cr = cairo_create(surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    if (snapshot != NULL) {
+        cairo_set_source_surface(cr, snapshot, 0, 0);
+    } else {
+        gdk_cairo_set_source_window(cr, gtk_widget_get_window(widget), 0, 0);
+    }
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    return surface;
+}
+
+
+gboolean
+systray_socket_is_placeholder(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    return socket->placeholder != NULL;
+}
+
+
+void
+systray_socket_send_button(SystraySocket *socket, GdkEventButton *event, gint x, gint y) {
+    GdkDisplay *display;
+    XEvent xev;
+
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+    g_return_if_fail(event != NULL);
+
+    display = gtk_widget_get_display(GTK_WIDGET(socket));
+
+    /* the client reacts to the click where it is, popups open at the
+     * pointer because of the root coordinates. sent events are flagged as
+     * such, and clients ignoring them (qt, the xembed-sni proxies) can't
+     * be clicked from the drawer */
+    memset(&xev, 0, sizeof(xev));
+    xev.xbutton.type = event->type == GDK_BUTTON_RELEASE ? ButtonRelease : ButtonPress;
+    xev.xbutton.display = GDK_DISPLAY_XDISPLAY(display);
+    xev.xbutton.window = socket->window;
+    xev.xbutton.root = GDK_WINDOW_XID(gdk_screen_get_root_window(
+        gtk_widget_get_screen(GTK_WIDGET(socket))));
+    xev.xbutton.subwindow = None;
+    xev.xbutton.time = event->time;
+    xev.xbutton.x = x;
+    xev.xbutton.y = y;
+    xev.xbutton.x_root = (gint)event->x_root;
+    xev.xbutton.y_root = (gint)event->y_root;
+    xev.xbutton.state = event->state;
+    xev.xbutton.button = event->button;
+    xev.xbutton.same_screen = True;
+
+    gdk_error_trap_push();
+    XSendEvent(GDK_DISPLAY_XDISPLAY(display), socket->window, False,
+               event->type == GDK_BUTTON_RELEASE ? ButtonReleaseMask : ButtonPressMask,
+               &xev);
+    gdk_error_trap_pop_ignored();
+
+    socket->stats.n_clicks_forwarded++;
+}
+
+
+void
+systray_socket_set_max_fps(SystraySocket *socket, guint max_fps) {
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+
+    socket->max_fps = max_fps;
+
+    /* don't keep damage waiting for a limit that is gone */
+    if (max_fps == 0 && socket->release_id != 0) {
+        g_source_remove(socket->release_id);
+        systray_socket_release_damage(socket);
+    }
+}
+
+
+guint
+systray_socket_get_max_fps(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), 0);
+
+    return socket->max_fps;
+}
+
+
+void
+systray_socket_set_suspended(SystraySocket *socket, gboolean suspended) {
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+
+    if (socket->suspended == !!suspended) {
+        return;
+    }
+
+    socket->suspended = !!suspended;
+
+    if (suspended) {
+        /* damage held back by the refresh limit stays held */
+        if (socket->release_id != 0) {
+            g_source_remove(socket->release_id);
+            socket->release_id = 0;
+        }
+    } else {
+        /* everything that happened meanwhile turns into a single repaint */
+        systray_socket_release_damage(socket);
+
+        if (socket->redraw_pending) {
+            socket->redraw_pending = FALSE;
+            systray_socket_force_redraw(socket);
+        }
+    }
+}
+
+
+gboolean
+systray_socket_embed(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    if (socket->embedded) {
+        return TRUE;
+    }
+
+    if (socket->placeholder != NULL) {
+        return FALSE;
+    }
+
+    /* the socket id can only be set with a toplevel window */
+    if (!GTK_IS_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(socket)))) {
+        return FALSE;
+    }
+
+    socket->embedded = TRUE;
+    gtk_socket_add_id(GTK_SOCKET(socket), socket->window);
+
+    return TRUE;
+}
+
+
+gboolean
+systray_socket_is_embedded(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    return socket->embedded;
+}
+
+
+static GdkFilterReturn
+systray_socket_watch_filter(GdkXEvent *xev, GdkEvent *event, gpointer user_data) {
+    XEvent *xevent = (XEvent *)xev;
+    SystraySocket *socket;
+
+    /* gdk has no windows for the watched clients, one filter looks up the
+     * socket for all of them */
+    socket = g_hash_table_lookup((GHashTable *)user_data,
+                                 GUINT_TO_POINTER(xevent->xany.window));
+    if (socket == NULL) {
+        return GDK_FILTER_CONTINUE;
+    }
+
+    return systray_socket_plug_filter(xev, event, socket);
+}
+
+
+static void
+systray_socket_watch_destroy(gpointer data) {
+    gdk_window_remove_filter(NULL, systray_socket_watch_filter, data);
+    g_hash_table_destroy((GHashTable *)data);
+}
+
+
+void
+systray_socket_watch_client(SystraySocket *socket) {
+    GdkDisplay *display;
+    GHashTable *watched;
+
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+
+    if (socket->embedded || socket->plug_window != NULL || socket->watching) {
+        return;
+    }
+
+    display = gtk_widget_get_display(GTK_WIDGET(socket));
+
+    watched = g_object_get_qdata(G_OBJECT(display), systray_socket_watch_quark());
+    if (G_UNLIKELY(watched == NULL)) {
+        watched = g_hash_table_new(NULL, NULL);
+        gdk_window_add_filter(NULL, systray_socket_watch_filter, watched);
+        g_object_set_qdata_full(G_OBJECT(display), systray_socket_watch_quark(),
+                                watched, systray_socket_watch_destroy);
+    }
+
+    g_hash_table_insert(watched, GUINT_TO_POINTER(socket->window), socket);
+    socket->watching = TRUE;
+    socket->watched = TRUE;
+
+    /* follow name changes and notice the client going away without
+     * embedding it, without waiting for the server. gtk selects its own
+     * events when it is embedded later */
+    gdk_error_trap_push();
+    XSelectInput(GDK_DISPLAY_XDISPLAY(display), socket->window,
+                 PropertyChangeMask | StructureNotifyMask);
+    gdk_error_trap_pop_ignored();
+
+    /* a client destroyed before this sends no DestroyNotify, the request
+     * fails instead. properties changed meanwhile are refreshed with it */
+    systray_socket_fetch_name(socket, display);
+    systray_socket_fetch_wm_class(socket, display);
+    systray_socket_fetch_xembed_info(socket, display);
+    systray_async_flush(display);
+}
+
+
+gboolean
+systray_socket_is_watched(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    return socket->watched;
+}
+
+
+gboolean
+systray_socket_get_name_known(SystraySocket *socket) {
+    g_return_val_if_fail(IS_SYSTRAY_SOCKET(socket), FALSE);
+
+    return socket->name_known;
+}
+
+
+void
+systray_socket_get_stats(SystraySocket *socket, SystraySocketStats *stats) {
+    g_return_if_fail(IS_SYSTRAY_SOCKET(socket));
+    g_return_if_fail(stats != NULL);
+
+    *stats = socket->stats;
+}
@@ -27,6 +27,7 @@
 
 typedef struct _SystraySocketClass SystraySocketClass;
 typedef struct _SystraySocket SystraySocket;
+typedef struct _SystraySocketStats SystraySocketStats;
 
 #define TYPE_SYSTRAY_SOCKET (systray_socket_get_type())
 #define SYSTRAY_SOCKET(obj) \
@@ -40,22 +41,89 @@ typedef struct _SystraySocket SystraySocket;
 #define SYSTRAY_SOCKET_GET_CLASS(obj) \
     (G_TYPE_INSTANCE_GET_CLASS((obj), TYPE_SYSTRAY_SOCKET, SystraySocketClass))
 
+#define TYPE_SYSTRAY_SOCKET_STATS (systray_socket_stats_get_type())
+
+/* counters of the socket since it was created */
+struct _SystraySocketStats {
+    /* times the icon was painted onto the tray */
+    guint64 n_composites;
+
+    /* damage notifies of a composited icon, and how many of them were
+     * merged into a later repaint because of the refresh limit */
+    guint64 n_damages;
+    guint64 n_damages_coalesced;
+
+    /* exposes sent to the plug, and redraws that were asked for while
+     * one was already queued for the next frame */
+    guint64 n_exposes;
+    guint64 n_exposes_merged;
+
+    /* copies taken of the icon while it is offscreen, and clicks sent to
+     * it from the drawer */
+    guint64 n_snapshots;
+    guint64 n_clicks_forwarded;
+};
+
 GType systray_socket_get_type(void) G_GNUC_CONST;
 
+GType systray_socket_stats_get_type(void) G_GNUC_CONST;
+
 void systray_socket_register_type(GTypeModule *type_module);
 
-GtkWidget *systray_socket_new(GdkScreen *screen, Window window) G_GNUC_MALLOC;
+GtkWidget *systray_socket_new(GdkScreen *screen, Window window,
+                              GdkVisual *visual) G_GNUC_MALLOC;
+
+GtkWidget *systray_socket_new_placeholder(const gchar *name,
+                                          cairo_surface_t *surface) G_GNUC_MALLOC;
+
+gboolean systray_socket_is_placeholder(SystraySocket *socket);
+
+gboolean systray_socket_embed(SystraySocket *socket);
+
+gboolean systray_socket_is_embedded(SystraySocket *socket);
+
+void systray_socket_watch_client(SystraySocket *socket);
+
+gboolean systray_socket_is_watched(SystraySocket *socket);
 
 void systray_socket_force_redraw(SystraySocket *socket);
 
 gboolean systray_socket_is_composited(SystraySocket *socket);
 
+void systray_socket_composite(SystraySocket *socket, cairo_t *cr);
+
 const gchar *systray_socket_get_name(SystraySocket *socket);
 
+gboolean systray_socket_get_name_known(SystraySocket *socket);
+
+const gchar *systray_socket_get_wm_class(SystraySocket *socket);
+
+gboolean systray_socket_get_xembed_info(SystraySocket *socket, guint32 *version,
+                                        guint32 *flags);
+
 Window systray_socket_get_window(SystraySocket *socket);
 
 gboolean systray_socket_get_hidden(SystraySocket *socket);
 
 void systray_socket_set_hidden(SystraySocket *socket, gboolean hidden);
 
+void systray_socket_set_offscreen(SystraySocket *socket, gboolean offscreen);
+
+gboolean systray_socket_get_offscreen(SystraySocket *socket);
+
+cairo_surface_t *systray_socket_get_snapshot(SystraySocket *socket);
+
+cairo_surface_t *systray_socket_capture(SystraySocket *socket);
+
+void systray_socket_send_button(SystraySocket *socket, GdkEventButton *event, gint x,
+                                gint y);
+
+void systray_socket_set_max_fps(SystraySocket *socket, guint max_fps);
+
+guint systray_socket_get_max_fps(SystraySocket *socket);
+
+void systray_socket_set_suspended(SystraySocket *socket, gboolean suspended);
+
+void systray_socket_get_stats(SystraySocket *socket, SystraySocketStats *stats);
+
 #endif /* !__SYSTRAY_SOCKET_H__ */
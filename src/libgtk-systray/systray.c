@@ -19,6 +19,7 @@
 
 #include "systray.h"
 #include "systray-box.h"
+#include "systray-cache.h"
 #include "systray-manager.h"
 #include "systray-socket.h"
 
@@ -29,6 +30,12 @@
 #define BUTTON_SIZE (16)
 #define FRAME_SPACING (1)
 
+/* icons of applications not seen for a week are dropped from the cache,
+ * placeholders of those that do not dock again after startup go away */
+#define CACHE_MAX_AGE (7 * 24 * 60 * 60)
+#define CACHE_SAVE_DELAY (10)
+#define PLACEHOLDER_TIMEOUT (30)
+
 
 static void systray_get_property(GObject *object, guint prop_id, GValue *value,
         GParamSpec *pspec);
@@ -38,6 +45,12 @@ static void systray_set_property(GObject *object, guint prop_id,
 
 static void systray_construct(GtkWidget *panel_plugin);
 
+static void systray_realized(GtkWidget *widget);
+
+static void systray_toplevel_changed(GtkWidget *widget, GtkWidget *previous_toplevel);
+
+static void systray_visibility_update(Systray *plugin);
+
 static void systray_free_data(GtkWidget *panel_plugin);
 
 static void systray_orientation_changed(GtkWidget *panel_plugin,
@@ -47,12 +60,14 @@ static gboolean systray_size_changed(GtkWidget *panel_plugin, gint size);
 
 static void systray_configure_plugin(GtkWidget *panel_plugin);
 
-static void systray_box_expose_event(GtkWidget *box, cairo_t *cr);
+static void systray_box_expose_event(GtkWidget *box, cairo_t *cr, Systray *plugin);
 
 static void systray_button_toggled(GtkWidget *button, Systray *plugin);
 
 static void systray_button_set_arrow(Systray *plugin);
 
+static void systray_drawer_update(Systray *plugin);
+
 static void systray_names_collect_visible(gpointer key, gpointer value,
         gpointer user_data);
 
@@ -62,16 +77,40 @@ static void systray_names_collect_hidden(gpointer key, gpointer value,
 static gboolean systray_names_remove(gpointer key, gpointer value,
         gpointer user_data);
 
+static void systray_names_update_icon(GtkWidget *icon, gpointer data);
+
 static void systray_names_update(Systray *plugin);
 
 static gboolean systray_names_get_hidden(Systray *plugin, const gchar *name);
 
+static void systray_icon_set_max_fps(GtkWidget *icon, gpointer data);
+
 static void systray_icon_added(SystrayManager *manager, GtkWidget *icon,
         Systray *plugin);
 
+static void systray_icons_added(SystrayManager *manager, GPtrArray *icons,
+        Systray *plugin);
+
+static void systray_icon_plug_added(GtkSocket *socket, Systray *plugin);
+
+static void systray_icon_name_changed(SystraySocket *socket, Systray *plugin);
+
+static void systray_icon_update_embed(GtkWidget *icon, gpointer data);
+
+static void systray_icon_wm_class_changed(SystraySocket *socket, Systray *plugin);
+
+static void systray_icon_snapshot_changed(SystraySocket *socket, Systray *plugin);
+
+static void systray_cache_queue_save(Systray *plugin);
+
+static void systray_placeholders_replace(Systray *plugin, SystraySocket *socket);
+
 static void systray_icon_removed(SystrayManager *manager, GtkWidget *icon,
         Systray *plugin);
 
+static void systray_icons_removed(SystrayManager *manager, GPtrArray *icons,
+        Systray *plugin);
+
 static void systray_lost_selection(SystrayManager *manager, Systray *plugin);
 
 
@@ -88,8 +127,43 @@ struct _Systray {
 
     guint idle_startup;
 
+    /* register as soon as the widget is realized */
+    guint fast_start : 1;
+
+    /* repaint limit for every icon, 0 for none */
+    guint icon_max_fps;
+
+    /* time the manager collects docking icons before adding them */
+    guint dock_settle;
+
+    /* embed icons only once they are shown */
+    guint lazy_embed : 1;
+
+    /* last known icons, painted as placeholders until their clients dock
+     * again after startup */
+    guint icon_cache : 1;
+    SystrayCache *cache;
+    GHashTable *placeholders;
+    guint placeholders_timeout_id;
+    guint cache_save_id;
+    guint cache_save_pending : 1;
+
+    /* suspend icon repaints while the tray can't be seen */
+    guint pause_invisible : 1;
+    guint tray_visible : 1;
+    GdkVisibilityState visibility;
+
     /* widgets */
     GtkWidget *box;
+    GtkWidget *button;
+
+    /* popup showing snapshots of the hidden icons, which stay embedded
+     * offscreen. the icon of the last press in it gets the release too */
+    GtkWidget *drawer;
+    GtkWidget *drawer_area;
+    GPtrArray *drawer_icons;
+    gint drawer_cell;
+    gint drawer_pressed;
 
     /* settings */
     GHashTable *names;
@@ -100,7 +174,14 @@ enum {
     PROP_0,
     PROP_SIZE_MAX,
     PROP_NAMES_HIDDEN,
-    PROP_NAMES_VISIBLE
+    PROP_NAMES_VISIBLE,
+    PROP_FAST_START,
+    PROP_ICON_MAX_FPS,
+    PROP_PAUSE_INVISIBLE,
+    PROP_DOCK_SETTLE,
+    PROP_LAZY_EMBED,
+    PROP_SHOW_HIDDEN,
+    PROP_ICON_CACHE
 };
 
 enum {
@@ -148,6 +229,36 @@ systray_class_init(SystrayClass *klass) {
     g_object_class_install_property(gobject_class, PROP_NAMES_VISIBLE,
             g_param_spec_boxed("names-visible", NULL, NULL, G_TYPE_STRV,
             G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_FAST_START,
+            g_param_spec_boolean("fast-start", NULL, NULL, FALSE,
+            G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_ICON_MAX_FPS,
+            g_param_spec_uint("icon-max-fps", NULL, NULL, 0, G_MAXUINT, 0,
+            G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_PAUSE_INVISIBLE,
+            g_param_spec_boolean("pause-invisible", NULL, NULL, TRUE,
+            G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_DOCK_SETTLE,
+            g_param_spec_uint("dock-settle", NULL, NULL, 0, G_MAXUINT, 0,
+            G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_LAZY_EMBED,
+            g_param_spec_boolean("lazy-embed", NULL, NULL, FALSE,
+            G_PARAM_READWRITE));
+
+    /* hidden icons show in the drawer, clicks are forwarded as sent
+     * events that not every client accepts */
+    g_object_class_install_property(gobject_class, PROP_SHOW_HIDDEN,
+            g_param_spec_boolean("show-hidden", NULL, NULL, TRUE,
+            G_PARAM_READWRITE));
+
+    g_object_class_install_property(gobject_class, PROP_ICON_CACHE,
+            g_param_spec_boolean("icon-cache", NULL, NULL, FALSE,
+            G_PARAM_READWRITE));
 }
 
 
@@ -157,16 +268,57 @@ systray_init(Systray *plugin) {
 
     plugin->manager = NULL;
     plugin->idle_startup = 0;
+    plugin->fast_start = FALSE;
+    plugin->icon_max_fps = 0;
+    plugin->dock_settle = 0;
+    plugin->lazy_embed = FALSE;
+    plugin->icon_cache = FALSE;
+    plugin->cache = NULL;
+    plugin->placeholders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    plugin->placeholders_timeout_id = 0;
+    plugin->cache_save_id = 0;
+    plugin->cache_save_pending = FALSE;
+    plugin->pause_invisible = TRUE;
+    plugin->tray_visible = TRUE;
+    plugin->visibility = GDK_VISIBILITY_UNOBSCURED;
     plugin->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
     plugin->box = systray_box_new();
     systray_box_set_show_hidden(SYSTRAY_BOX(plugin->box), TRUE);
     gtk_box_pack_start(GTK_BOX(plugin), plugin->box, TRUE, TRUE, 0);
-    g_signal_connect(G_OBJECT(plugin->box), "draw", G_CALLBACK(systray_box_expose_event), NULL);
+    g_signal_connect(G_OBJECT(plugin->box), "draw", G_CALLBACK(systray_box_expose_event),
+                     plugin);
     gtk_container_set_border_width(GTK_CONTAINER(plugin->box), FRAME_SPACING);
     gtk_widget_show(plugin->box);
 
+    /* shown while there are hidden icons */
+    plugin->button = gtk_toggle_button_new();
+    gtk_button_set_relief(GTK_BUTTON(plugin->button), GTK_RELIEF_NONE);
+    gtk_widget_set_size_request(plugin->button, BUTTON_SIZE, BUTTON_SIZE);
+    gtk_widget_set_no_show_all(plugin->button, TRUE);
+    gtk_container_add(GTK_CONTAINER(plugin->button),
+                      gtk_arrow_new(GTK_ARROW_DOWN, GTK_SHADOW_NONE));
+    gtk_widget_show(gtk_bin_get_child(GTK_BIN(plugin->button)));
+    gtk_box_pack_start(GTK_BOX(plugin), plugin->button, FALSE, FALSE, 0);
+    g_signal_connect(G_OBJECT(plugin->button), "toggled",
+                     G_CALLBACK(systray_button_toggled), plugin);
+    systray_button_set_arrow(plugin);
+
+    plugin->drawer = NULL;
+    plugin->drawer_area = NULL;
+    plugin->drawer_icons = g_ptr_array_new();
+    plugin->drawer_cell = 0;
+    plugin->drawer_pressed = -1;
+
     g_signal_connect_after(G_OBJECT(plugin), "draw", G_CALLBACK(systray_construct), NULL);
+    g_signal_connect_after(G_OBJECT(plugin), "realize", G_CALLBACK(systray_realized), NULL);
+
+    g_signal_connect(G_OBJECT(plugin), "hierarchy-changed",
+                     G_CALLBACK(systray_toplevel_changed), NULL);
+    g_signal_connect_swapped(G_OBJECT(plugin), "map",
+                             G_CALLBACK(systray_visibility_update), plugin);
+    g_signal_connect_swapped(G_OBJECT(plugin), "unmap",
+                             G_CALLBACK(systray_visibility_update), plugin);
 }
 
 
@@ -202,6 +354,35 @@ systray_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *
             g_ptr_array_free(array, TRUE);
             break;
 
+        case PROP_FAST_START:
+            g_value_set_boolean(value, plugin->fast_start);
+            break;
+
+        case PROP_ICON_MAX_FPS:
+            g_value_set_uint(value, plugin->icon_max_fps);
+            break;
+
+        case PROP_PAUSE_INVISIBLE:
+            g_value_set_boolean(value, plugin->pause_invisible);
+            break;
+
+        case PROP_DOCK_SETTLE:
+            g_value_set_uint(value, plugin->dock_settle);
+            break;
+
+        case PROP_LAZY_EMBED:
+            g_value_set_boolean(value, plugin->lazy_embed);
+            break;
+
+        case PROP_ICON_CACHE:
+            g_value_set_boolean(value, plugin->icon_cache);
+            break;
+
+        case PROP_SHOW_HIDDEN:
+            g_value_set_boolean(value,
+                                systray_box_get_show_hidden(SYSTRAY_BOX(plugin->box)));
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
             break;
@@ -250,6 +431,55 @@ systray_set_property(GObject *object, guint prop_id, const GValue *value, GParam
             systray_names_update(plugin);
             break;
 
+        case PROP_FAST_START:
+            plugin->fast_start = g_value_get_boolean(value);
+            break;
+
+        case PROP_ICON_MAX_FPS:
+            plugin->icon_max_fps = g_value_get_uint(value);
+            gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_icon_set_max_fps,
+                                  plugin);
+            break;
+
+        case PROP_PAUSE_INVISIBLE:
+            plugin->pause_invisible = g_value_get_boolean(value);
+            systray_visibility_update(plugin);
+            break;
+
+        case PROP_DOCK_SETTLE:
+            plugin->dock_settle = g_value_get_uint(value);
+            if (plugin->manager != NULL) {
+                g_object_set(G_OBJECT(plugin->manager), "dock-settle", plugin->dock_settle,
+                             NULL);
+            }
+            break;
+
+        case PROP_LAZY_EMBED:
+            plugin->lazy_embed = g_value_get_boolean(value);
+            if (plugin->manager != NULL) {
+                g_object_set(G_OBJECT(plugin->manager), "lazy-embed", plugin->lazy_embed,
+                             NULL);
+            }
+            gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_icon_update_embed,
+                                  plugin);
+            systray_drawer_update(plugin);
+            break;
+
+        case PROP_SHOW_HIDDEN:
+            systray_box_set_show_hidden(SYSTRAY_BOX(plugin->box),
+                                        g_value_get_boolean(value));
+            gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_names_update_icon,
+                                  plugin);
+            gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_icon_update_embed,
+                                  plugin);
+            systray_drawer_update(plugin);
+            break;
+
+        case PROP_ICON_CACHE:
+            /* used the next time the tray starts */
+            plugin->icon_cache = g_value_get_boolean(value);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
             break;
@@ -257,18 +487,172 @@ systray_set_property(GObject *object, guint prop_id, const GValue *value, GParam
 }
 
 
+static void
+systray_placeholder_add(const gchar *key, cairo_surface_t *surface, gpointer user_data) {
+    Systray *plugin = SYSTRAY(user_data);
+    GtkWidget *placeholder;
+
+    /* hidden icons would not be seen anyway */
+    if (GPOINTER_TO_UINT(g_hash_table_lookup(plugin->names, key)) == 1 ||
+        g_hash_table_contains(plugin->placeholders, key)) {
+        return;
+    }
+
+    placeholder = systray_socket_new_placeholder(key, surface);
+    g_hash_table_insert(plugin->placeholders, g_strdup(key), placeholder);
+    gtk_container_add(GTK_CONTAINER(plugin->box), placeholder);
+    gtk_widget_show(placeholder);
+}
+
+
+static void
+systray_placeholder_remove(gpointer key, gpointer value, gpointer user_data) {
+    gtk_container_remove(GTK_CONTAINER(SYSTRAY(user_data)->box), GTK_WIDGET(value));
+}
+
+
 static gboolean
-systray_screen_changed_idle(gpointer user_data) {
+systray_placeholders_timeout(gpointer user_data) {
     Systray *plugin = SYSTRAY(user_data);
+
+    /* these applications did not start this time */
+    g_debug("removing %u placeholders", g_hash_table_size(plugin->placeholders));
+
+    plugin->placeholders_timeout_id = 0;
+    g_hash_table_foreach(plugin->placeholders, systray_placeholder_remove, plugin);
+    g_hash_table_remove_all(plugin->placeholders);
+
+    return FALSE;
+}
+
+
+static void
+systray_placeholders_replace(Systray *plugin, SystraySocket *socket) {
+    const gchar *keys[2];
+    GtkWidget *placeholder;
+    guint i;
+
+    /* the cache is keyed by the name, or by the class of nameless icons */
+    keys[0] = systray_socket_get_name(socket);
+    keys[1] = systray_socket_get_wm_class(socket);
+    for (i = 0; i < G_N_ELEMENTS(keys); i++) {
+        placeholder = keys[i] != NULL ? g_hash_table_lookup(plugin->placeholders, keys[i])
+                                      : NULL;
+        if (placeholder != NULL) {
+            gtk_container_remove(GTK_CONTAINER(plugin->box), placeholder);
+            g_hash_table_remove(plugin->placeholders, keys[i]);
+        }
+    }
+}
+
+
+static void
+systray_cache_start(Systray *plugin, GdkScreen *screen) {
+    gchar *filename;
+
+    if (!plugin->icon_cache || plugin->cache != NULL) {
+        return;
+    }
+
+    /* the file is mapped, the placeholders paint straight from it */
+    filename = systray_cache_get_filename(screen);
+    plugin->cache = systray_cache_load(filename, CACHE_MAX_AGE);
+    g_free(filename);
+
+    systray_box_freeze(SYSTRAY_BOX(plugin->box));
+    systray_cache_foreach(plugin->cache, systray_placeholder_add, plugin);
+    systray_box_thaw(SYSTRAY_BOX(plugin->box));
+
+    if (g_hash_table_size(plugin->placeholders) > 0) {
+        plugin->placeholders_timeout_id = g_timeout_add_seconds(
+            PLACEHOLDER_TIMEOUT, systray_placeholders_timeout, plugin);
+    }
+}
+
+
+static void
+systray_cache_update_icon(GtkWidget *icon, gpointer data) {
+    Systray *plugin = SYSTRAY(data);
+    SystraySocket *socket = SYSTRAY_SOCKET(icon);
+    cairo_surface_t *surface;
+    const gchar *key;
+
+    if (systray_socket_is_placeholder(socket) || !systray_socket_get_name_known(socket)) {
+        return;
+    }
+
+    key = systray_socket_get_name(socket);
+    if (key == NULL || key[0] == '\0') {
+        key = systray_socket_get_wm_class(socket);
+    }
+    if (key == NULL || key[0] == '\0') {
+        return;
+    }
+
+    surface = systray_socket_capture(socket);
+    if (surface != NULL) {
+        systray_cache_set(plugin->cache, key, surface);
+        cairo_surface_destroy(surface);
+    }
+}
+
+
+static gboolean
+systray_cache_save_timeout(gpointer user_data) {
+    Systray *plugin = SYSTRAY(user_data);
+    GError *error = NULL;
+
+    /* the content of covered icons can't be read, save once the tray
+     * can be seen again */
+    if (!plugin->tray_visible) {
+        plugin->cache_save_pending = TRUE;
+        return FALSE;
+    }
+
+    gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_cache_update_icon, plugin);
+    if (!systray_cache_save(plugin->cache, &error)) {
+        g_warning("Unable to save the icon cache: %s", error->message);
+        g_error_free(error);
+    }
+
+    return FALSE;
+}
+
+
+static void
+systray_cache_save_destroyed(gpointer user_data) {
+    SYSTRAY(user_data)->cache_save_id = 0;
+}
+
+
+static void
+systray_cache_queue_save(Systray *plugin) {
+    /* once the icons settled after docking */
+    if (plugin->cache != NULL && plugin->cache_save_id == 0) {
+        plugin->cache_save_id = g_timeout_add_seconds_full(
+            G_PRIORITY_LOW, CACHE_SAVE_DELAY, systray_cache_save_timeout, plugin,
+            systray_cache_save_destroyed);
+    }
+}
+
+
+static void
+systray_start(Systray *plugin) {
     GdkScreen *screen;
     GError *error = NULL;
 
     /* create a new manager and register this screen */
     plugin->manager = systray_manager_new();
+    g_object_set(G_OBJECT(plugin->manager), "dock-settle", plugin->dock_settle,
+                 "lazy-embed", plugin->lazy_embed, NULL);
     g_signal_connect(G_OBJECT(plugin->manager), "icon-added",
                      G_CALLBACK(systray_icon_added), plugin);
+    g_signal_connect(G_OBJECT(plugin->manager), "icons-added",
+                     G_CALLBACK(systray_icons_added), plugin);
     g_signal_connect(G_OBJECT(plugin->manager), "icon-removed",
                      G_CALLBACK(systray_icon_removed), plugin);
+    g_signal_connect(G_OBJECT(plugin->manager), "icons-removed",
+                     G_CALLBACK(systray_icons_removed), plugin);
     g_signal_connect(G_OBJECT(plugin->manager), "lost-selection",
                      G_CALLBACK(systray_lost_selection), plugin);
 
@@ -276,10 +660,19 @@ systray_screen_changed_idle(gpointer user_data) {
     screen = gtk_widget_get_screen(GTK_WIDGET(plugin));
     if (systray_manager_register(plugin->manager, screen, &error)) {
         systray_orientation_changed(GTK_WIDGET(plugin), GTK_ORIENTATION_HORIZONTAL);
+
+        /* don't wait for the clients to dock and draw */
+        systray_cache_start(plugin, screen);
     } else {
         g_error("Unable to start the notification area");
         g_error_free(error);
     }
+}
+
+
+static gboolean
+systray_screen_changed_idle(gpointer user_data) {
+    systray_start(SYSTRAY(user_data));
 
     return FALSE;
 }
@@ -302,6 +695,16 @@ systray_screen_changed(GtkWidget *widget, GdkScreen *previous_screen) {
         plugin->manager = NULL;
     }
 
+    /* in fast-start mode, take the selection right away */
+    if (plugin->fast_start && gtk_widget_get_realized(widget)) {
+        if (plugin->idle_startup != 0) {
+            g_source_remove(plugin->idle_startup);
+        }
+
+        systray_start(plugin);
+        return;
+    }
+
     /* schedule a delayed startup */
     if (plugin->idle_startup == 0) {
         plugin->idle_startup = g_idle_add_full(G_PRIORITY_LOW, systray_screen_changed_idle,
@@ -312,8 +715,15 @@ systray_screen_changed(GtkWidget *widget, GdkScreen *previous_screen) {
 
 static void
 systray_composited_changed(GtkWidget *widget) {
-    /* restart the manager to add the sockets again */
-    systray_screen_changed(widget, gtk_widget_get_screen(widget));
+    Systray *plugin = SYSTRAY(widget);
+
+    /* keep the selection and the embedded icons, only the visual advertised
+     * to icons docking from now on changes */
+    if (G_LIKELY(plugin->manager != NULL)) {
+        systray_manager_update_visual(plugin->manager);
+    }
+
+    gtk_widget_queue_draw(plugin->box);
 }
 
 
@@ -321,15 +731,107 @@ static void
 systray_construct(GtkWidget *plugin) {
     /* monitor screen changes */
     g_signal_connect(G_OBJECT(plugin), "screen-changed", G_CALLBACK(systray_screen_changed), NULL);
-    systray_screen_changed(GTK_WIDGET(plugin), NULL);
 
-    /* restart internally if compositing changed */
+    /* update the visuals if compositing changed */
     g_signal_connect(G_OBJECT(plugin), "composited-changed",
             G_CALLBACK(systray_composited_changed), NULL);
 
+    g_signal_handlers_disconnect_by_func(G_OBJECT(plugin), systray_construct, NULL);
+    g_signal_handlers_disconnect_by_func(G_OBJECT(plugin), systray_realized, NULL);
+
     systray_screen_changed(GTK_WIDGET(plugin), NULL);
+}
 
-    g_signal_handlers_disconnect_by_func(G_OBJECT(plugin), systray_construct, NULL);
+
+static void
+systray_realized(GtkWidget *widget) {
+    /* don't wait for the first draw to start the manager */
+    if (SYSTRAY(widget)->fast_start) {
+        systray_construct(widget);
+    }
+}
+
+
+static void
+systray_icon_set_suspended(GtkWidget *icon, gpointer data) {
+    systray_socket_set_suspended(SYSTRAY_SOCKET(icon), !SYSTRAY(data)->tray_visible);
+}
+
+
+static void
+systray_visibility_update(Systray *plugin) {
+    GtkWidget *widget = GTK_WIDGET(plugin);
+    gboolean visible;
+
+    /* unmapped, on another workspace or covered by other windows */
+    visible = !plugin->pause_invisible ||
+              (gtk_widget_get_mapped(widget) &&
+               gdk_window_is_viewable(gtk_widget_get_window(widget)) &&
+               plugin->visibility != GDK_VISIBILITY_FULLY_OBSCURED);
+
+    if (plugin->tray_visible == visible) {
+        return;
+    }
+
+    g_debug("tray %s", visible ? "visible, resuming repaints" : "invisible, pausing repaints");
+
+    plugin->tray_visible = visible;
+    gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_icon_set_suspended, plugin);
+
+    /* repaint what changed meanwhile at once */
+    if (visible) {
+        gtk_widget_queue_draw(plugin->box);
+
+        if (plugin->cache_save_pending) {
+            plugin->cache_save_pending = FALSE;
+            systray_cache_queue_save(plugin);
+        }
+    }
+}
+
+
+static gboolean
+systray_toplevel_visibility(GtkWidget *toplevel, GdkEventVisibility *event, Systray *plugin) {
+    plugin->visibility = event->state;
+    systray_visibility_update(plugin);
+
+    return FALSE;
+}
+
+
+static gboolean
+systray_toplevel_map(GtkWidget *toplevel, GdkEvent *event, Systray *plugin) {
+    /* the window manager (un)mapped the panel, e.g. on a workspace switch */
+    if (event->type == GDK_MAP) {
+        plugin->visibility = GDK_VISIBILITY_UNOBSCURED;
+    }
+    systray_visibility_update(plugin);
+
+    return FALSE;
+}
+
+
+static void
+systray_toplevel_changed(GtkWidget *widget, GtkWidget *previous_toplevel) {
+    Systray *plugin = SYSTRAY(widget);
+    GtkWidget *toplevel;
+
+    if (previous_toplevel != NULL) {
+        g_signal_handlers_disconnect_by_data(G_OBJECT(previous_toplevel), plugin);
+    }
+
+    toplevel = gtk_widget_get_toplevel(widget);
+    if (!gtk_widget_is_toplevel(toplevel)) {
+        return;
+    }
+
+    gtk_widget_add_events(toplevel, GDK_VISIBILITY_NOTIFY_MASK | GDK_STRUCTURE_MASK);
+    g_signal_connect_object(G_OBJECT(toplevel), "visibility-notify-event",
+                            G_CALLBACK(systray_toplevel_visibility), plugin, 0);
+    g_signal_connect_object(G_OBJECT(toplevel), "map-event",
+                            G_CALLBACK(systray_toplevel_map), plugin, 0);
+    g_signal_connect_object(G_OBJECT(toplevel), "unmap-event",
+                            G_CALLBACK(systray_toplevel_map), plugin, 0);
 }
 
 
@@ -347,6 +849,22 @@ systray_free_data(GtkWidget *panel_plugin) {
 
     g_hash_table_destroy(plugin->names);
 
+    if (plugin->drawer != NULL) {
+        gtk_widget_destroy(plugin->drawer);
+    }
+    g_ptr_array_free(plugin->drawer_icons, TRUE);
+
+    if (plugin->placeholders_timeout_id != 0) {
+        g_source_remove(plugin->placeholders_timeout_id);
+    }
+    if (plugin->cache_save_id != 0) {
+        g_source_remove(plugin->cache_save_id);
+    }
+    g_hash_table_destroy(plugin->placeholders);
+    if (plugin->cache != NULL) {
+        systray_cache_free(plugin->cache);
+    }
+
     if (G_LIKELY(plugin->manager != NULL)) {
         systray_manager_unregister(plugin->manager);
         g_object_unref(G_OBJECT(plugin->manager));
@@ -360,6 +878,7 @@ systray_orientation_changed(GtkWidget *panel_plugin, GtkOrientation orientation)
 
     // xfce_hvbox_set_orientation (HVBOX (plugin->hbox), orientation);
     systray_box_set_orientation(SYSTRAY_BOX(plugin->box), orientation);
+    systray_button_set_arrow(plugin);
 
     if (G_LIKELY(plugin->manager != NULL)) {
         systray_manager_set_orientation(plugin->manager, orientation);
@@ -381,42 +900,311 @@ systray_configure_plugin(GtkWidget *panel_plugin) {
 }
 
 
+typedef struct {
+    cairo_t *cr;
+
+    /* parts of the box being redrawn */
+    cairo_rectangle_list_t *clip;
+} SystrayExpose;
+
+
+static gboolean
+systray_box_expose_event_damaged(SystrayExpose *expose, const GtkAllocation *alloc) {
+    cairo_rectangle_t *rect;
+    gint i;
+
+    /* without a usable rectangle list, everything counts as damaged */
+    if (expose->clip == NULL || expose->clip->status != CAIRO_STATUS_SUCCESS) {
+        return TRUE;
+    }
+
+    for (i = 0; i < expose->clip->num_rectangles; i++) {
+        rect = &expose->clip->rectangles[i];
+        if (rect->x < alloc->x + alloc->width && alloc->x < rect->x + rect->width &&
+            rect->y < alloc->y + alloc->height && alloc->y < rect->y + rect->height) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
 static void
 systray_box_expose_event_icon(GtkWidget *child, gpointer user_data) {
-    cairo_t *cr = user_data;
+    SystrayExpose *expose = user_data;
     GtkAllocation alloc;
 
     if (systray_socket_is_composited(SYSTRAY_SOCKET(child))) {
         gtk_widget_get_allocation(child, &alloc);
 
-        /* skip hidden (see offscreen in box widget) icons */
-        if (alloc.x > -1 && alloc.y > -1) {
-            gdk_cairo_set_source_window(cr, gtk_widget_get_window(child), alloc.x, alloc.y);
-            cairo_paint(cr);
+        /* skip hidden (see offscreen in box widget) icons, and icons outside
+         * the redrawn area. those would be clipped away anyway, but painting
+         * them still costs a trip through the render extension */
+        if (alloc.x > -1 && alloc.y > -1 &&
+            systray_box_expose_event_damaged(expose, &alloc)) {
+            systray_socket_composite(SYSTRAY_SOCKET(child), expose->cr);
         }
     }
 }
 
 
 static void
-systray_box_expose_event(GtkWidget *box, cairo_t *cr) {
-    if (!gtk_widget_is_composited(box)) return;
+systray_box_expose_event(GtkWidget *box, cairo_t *cr, Systray *plugin) {
+    SystrayExpose expose;
+    GdkRectangle extents;
+
+    /* icons are painted again when the tray becomes visible */
+    if (!plugin->tray_visible) {
+        return;
+    }
+
+    /* composited sockets are redirected by gdk whether or not a compositing
+     * manager runs, so they have to be painted in both cases */
+    if (G_LIKELY(cr != NULL) && gdk_cairo_get_clip_rectangle(cr, &extents)) {
+        /* gdk tracks the damage of the redirected windows and only
+         * invalidates the area of the icons that changed */
+        expose.cr = cr;
+        expose.clip = cairo_copy_clip_rectangle_list(cr);
+
+        /* separately draw the composed tray icons in the redrawn area after
+         * gtk handled the expose event */
+        systray_box_foreach_in_rect(SYSTRAY_BOX(box), &extents,
+                                    systray_box_expose_event_icon, &expose);
 
-    if (G_LIKELY(cr != NULL)) {
-        /* separately draw all the composed tray icons after gtk
-         * handled the expose event */
-        gtk_container_foreach(GTK_CONTAINER(box), systray_box_expose_event_icon, cr);
+        cairo_rectangle_list_destroy(expose.clip);
+    }
+}
+
+
+static void
+systray_drawer_cell(Systray *plugin, guint i, gint *x, gint *y) {
+    /* the icons are lined up like in the tray */
+    if (systray_box_get_orientation(SYSTRAY_BOX(plugin->box)) ==
+        GTK_ORIENTATION_HORIZONTAL) {
+        *x = i * plugin->drawer_cell;
+        *y = 0;
+    } else {
+        *x = 0;
+        *y = i * plugin->drawer_cell;
+    }
+}
+
+
+static gboolean
+systray_drawer_draw(GtkWidget *area, cairo_t *cr, Systray *plugin) {
+    cairo_surface_t *snapshot;
+    GtkAllocation alloc;
+    GtkWidget *icon;
+    gint x, y;
+    guint i;
+
+    /* the snapshots are only taken again for icons that were damaged since,
+     * so this is a blit per icon */
+    for (i = 0; i < plugin->drawer_icons->len; i++) {
+        icon = g_ptr_array_index(plugin->drawer_icons, i);
+        snapshot = systray_socket_get_snapshot(SYSTRAY_SOCKET(icon));
+        if (snapshot == NULL) {
+            continue;
+        }
+
+        gtk_widget_get_allocation(icon, &alloc);
+        systray_drawer_cell(plugin, i, &x, &y);
+        x += (plugin->drawer_cell - alloc.width) / 2;
+        y += (plugin->drawer_cell - alloc.height) / 2;
+
+        cairo_set_source_surface(cr, snapshot, x, y);
+        cairo_rectangle(cr, x, y, alloc.width, alloc.height);
+        cairo_fill(cr);
+    }
+
+    return FALSE;
+}
+
+
+static void
+systray_drawer_forward(Systray *plugin, guint i, GdkEventButton *event) {
+    GtkWidget *icon = g_ptr_array_index(plugin->drawer_icons, i);
+    GtkAllocation alloc;
+    gint x, y;
+
+    gtk_widget_get_allocation(icon, &alloc);
+    systray_drawer_cell(plugin, i, &x, &y);
+    x += (plugin->drawer_cell - alloc.width) / 2;
+    y += (plugin->drawer_cell - alloc.height) / 2;
+
+    systray_socket_send_button(SYSTRAY_SOCKET(icon), event, (gint)event->x - x,
+                               (gint)event->y - y);
+}
+
+
+static gboolean
+systray_drawer_button_press(GtkWidget *area, GdkEventButton *event, Systray *plugin) {
+    gint i;
+
+    if (plugin->drawer_cell < 1) {
+        return FALSE;
+    }
+
+    i = (systray_box_get_orientation(SYSTRAY_BOX(plugin->box)) ==
+         GTK_ORIENTATION_HORIZONTAL ? (gint)event->x : (gint)event->y) /
+        plugin->drawer_cell;
+    if (i < 0 || i >= (gint)plugin->drawer_icons->len) {
+        return FALSE;
+    }
+
+    /* the real icon gets the click where it is */
+    plugin->drawer_pressed = i;
+    systray_drawer_forward(plugin, i, event);
+
+    return TRUE;
+}
+
+
+static gboolean
+systray_drawer_button_release(GtkWidget *area, GdkEventButton *event, Systray *plugin) {
+    if (plugin->drawer_pressed < 0) {
+        return FALSE;
+    }
+
+    systray_drawer_forward(plugin, plugin->drawer_pressed, event);
+    plugin->drawer_pressed = -1;
+
+    /* like a menu, the drawer closes once an icon was used */
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(plugin->button), FALSE);
+
+    return TRUE;
+}
+
+
+static void
+systray_drawer_collect(GtkWidget *icon, gpointer data) {
+    Systray *plugin = SYSTRAY(data);
+
+    /* only embedded icons have something to take a snapshot of, and only
+     * when their windows can be redirected */
+    if (systray_socket_get_offscreen(SYSTRAY_SOCKET(icon)) &&
+        systray_socket_is_embedded(SYSTRAY_SOCKET(icon)) &&
+        gdk_display_supports_composite(gtk_widget_get_display(icon))) {
+        g_ptr_array_add(plugin->drawer_icons, icon);
+    }
+}
+
+
+static void
+systray_drawer_place(Systray *plugin) {
+    GtkAllocation alloc;
+    GdkScreen *screen;
+    GtkWidget *icon;
+    gint x, y, width, height;
+    guint i;
+
+    if (plugin->drawer == NULL) {
+        plugin->drawer = gtk_window_new(GTK_WINDOW_POPUP);
+        g_signal_connect(G_OBJECT(plugin->drawer), "destroy",
+                         G_CALLBACK(gtk_widget_destroyed), &plugin->drawer);
+
+        plugin->drawer_area = gtk_drawing_area_new();
+        gtk_widget_add_events(plugin->drawer_area,
+                              GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK);
+        g_signal_connect(G_OBJECT(plugin->drawer_area), "draw",
+                         G_CALLBACK(systray_drawer_draw), plugin);
+        g_signal_connect(G_OBJECT(plugin->drawer_area), "button-press-event",
+                         G_CALLBACK(systray_drawer_button_press), plugin);
+        g_signal_connect(G_OBJECT(plugin->drawer_area), "button-release-event",
+                         G_CALLBACK(systray_drawer_button_release), plugin);
+        gtk_container_add(GTK_CONTAINER(plugin->drawer), plugin->drawer_area);
+        gtk_widget_show(plugin->drawer_area);
+    }
+
+    /* a cell fits the largest icon, they all have the tray row size */
+    plugin->drawer_cell = 0;
+    for (i = 0; i < plugin->drawer_icons->len; i++) {
+        icon = g_ptr_array_index(plugin->drawer_icons, i);
+        gtk_widget_get_allocation(icon, &alloc);
+        plugin->drawer_cell = MAX(plugin->drawer_cell, MAX(alloc.width, alloc.height));
+    }
+    plugin->drawer_cell = MAX(plugin->drawer_cell, 1);
+    systray_drawer_cell(plugin, plugin->drawer_icons->len, &width, &height);
+    width = MAX(width, plugin->drawer_cell);
+    height = MAX(height, plugin->drawer_cell);
+
+    /* next to the button, on the side facing away from the panel edge */
+    screen = gtk_widget_get_screen(GTK_WIDGET(plugin));
+    gdk_window_get_origin(gtk_widget_get_window(plugin->button), &x, &y);
+    gtk_widget_get_allocation(plugin->button, &alloc);
+    x += alloc.x;
+    y += alloc.y;
+    if (systray_box_get_orientation(SYSTRAY_BOX(plugin->box)) ==
+        GTK_ORIENTATION_HORIZONTAL) {
+        x += alloc.width - width;
+        y = y + alloc.height + height > gdk_screen_get_height(screen) ? y - height
+                                                                       : y + alloc.height;
+    } else {
+        x = x + alloc.width + width > gdk_screen_get_width(screen) ? x - width
+                                                                     : x + alloc.width;
+    }
+
+    gtk_window_set_screen(GTK_WINDOW(plugin->drawer), screen);
+    gtk_widget_set_size_request(plugin->drawer_area, width, height);
+    gtk_window_resize(GTK_WINDOW(plugin->drawer), width, height);
+    gtk_window_move(GTK_WINDOW(plugin->drawer), MAX(x, 0), MAX(y, 0));
+    gtk_widget_show(plugin->drawer);
+    gtk_widget_queue_draw(plugin->drawer_area);
+}
+
+
+static void
+systray_drawer_update(Systray *plugin) {
+    g_ptr_array_set_size(plugin->drawer_icons, 0);
+    plugin->drawer_pressed = -1;
+
+    if (!systray_box_get_show_hidden(SYSTRAY_BOX(plugin->box))) {
+        gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_drawer_collect, plugin);
+    }
+
+    gtk_widget_set_visible(plugin->button, plugin->drawer_icons->len > 0);
+    if (plugin->drawer_icons->len == 0) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(plugin->button), FALSE);
+    } else if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(plugin->button))) {
+        systray_drawer_place(plugin);
     }
 }
 
 
 static void
 systray_button_toggled(GtkWidget *button, Systray *plugin) {
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(button))) {
+        /* nothing is embedded or relayouted, the drawer paints the snapshots */
+        if (plugin->drawer_icons->len > 0) {
+            systray_drawer_place(plugin);
+        } else {
+            gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), FALSE);
+        }
+    } else if (plugin->drawer != NULL) {
+        gtk_widget_hide(plugin->drawer);
+        plugin->drawer_pressed = -1;
+    }
+
+    systray_button_set_arrow(plugin);
 }
 
 
 static void
 systray_button_set_arrow(Systray *plugin) {
+    GtkArrowType arrow_type;
+    gboolean active;
+
+    active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(plugin->button));
+    if (systray_box_get_orientation(SYSTRAY_BOX(plugin->box)) ==
+        GTK_ORIENTATION_HORIZONTAL) {
+        arrow_type = active ? GTK_ARROW_UP : GTK_ARROW_DOWN;
+    } else {
+        arrow_type = active ? GTK_ARROW_LEFT : GTK_ARROW_RIGHT;
+    }
+
+    gtk_arrow_set(GTK_ARROW(gtk_bin_get_child(GTK_BIN(plugin->button))), arrow_type,
+                  GTK_SHADOW_NONE);
 }
 
 
@@ -464,8 +1252,22 @@ systray_names_update_icon(GtkWidget *icon, gpointer data) {
     g_return_if_fail(IS_SYSTRAY(plugin));
     g_return_if_fail(IS_SYSTRAY_SOCKET(icon));
 
+    /* the name is fetched asynchronously, icons without one are visible */
     name = systray_socket_get_name(socket);
-    systray_socket_set_hidden(socket, systray_names_get_hidden(plugin, name));
+    if (name == NULL || name[0] == '\0') {
+        systray_socket_set_hidden(socket, FALSE);
+    } else if (systray_socket_is_placeholder(socket)) {
+        /* placeholders can be keyed by the class, which must not end up
+         * in the names the user configures */
+        systray_socket_set_hidden(socket,
+            GPOINTER_TO_UINT(g_hash_table_lookup(plugin->names, name)) == 1);
+    } else {
+        systray_socket_set_hidden(socket, systray_names_get_hidden(plugin, name));
+    }
+
+    /* hidden icons are kept offscreen for the drawer */
+    systray_socket_set_offscreen(socket, systray_socket_get_hidden(socket) &&
+                                 !systray_box_get_show_hidden(SYSTRAY_BOX(plugin->box)));
 }
 
 
@@ -474,18 +1276,32 @@ systray_names_update(Systray *plugin) {
     g_return_if_fail(IS_SYSTRAY(plugin));
 
     gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_names_update_icon, plugin);
+    gtk_container_foreach(GTK_CONTAINER(plugin->box), systray_icon_update_embed, plugin);
     systray_box_update(SYSTRAY_BOX(plugin->box));
+    systray_drawer_update(plugin);
 }
 
 
 static void
 systray_names_set_hidden(Systray *plugin, const gchar *name, gboolean hidden) {
+    GList *icons, *li;
+
     g_return_if_fail(IS_SYSTRAY(plugin));
     g_return_if_fail(name && name[0]);
 
     g_hash_table_replace(plugin->names, g_strdup(name), GUINT_TO_POINTER(hidden ? 1 : 0));
 
-    systray_names_update(plugin);
+    /* only the icons with this name change, move them in the box one by one */
+    icons = gtk_container_get_children(GTK_CONTAINER(plugin->box));
+    for (li = icons; li != NULL; li = li->next) {
+        if (g_strcmp0(systray_socket_get_name(SYSTRAY_SOCKET(li->data)), name) == 0) {
+            systray_names_update_icon(GTK_WIDGET(li->data), plugin);
+            systray_icon_update_embed(GTK_WIDGET(li->data), plugin);
+            systray_box_update_child(SYSTRAY_BOX(plugin->box), GTK_WIDGET(li->data));
+        }
+    }
+    g_list_free(icons);
+    systray_drawer_update(plugin);
 
     g_object_notify(G_OBJECT(plugin), "names-visible");
     g_object_notify(G_OBJECT(plugin), "names-hidden");
@@ -524,6 +1340,12 @@ systray_names_clear(Systray *plugin) {
 }
 
 
+static void
+systray_icon_set_max_fps(GtkWidget *icon, gpointer data) {
+    systray_socket_set_max_fps(SYSTRAY_SOCKET(icon), SYSTRAY(data)->icon_max_fps);
+}
+
+
 static void
 systray_icon_added(SystrayManager *manager, GtkWidget *icon, Systray *plugin) {
     g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
@@ -533,13 +1355,131 @@ systray_icon_added(SystrayManager *manager, GtkWidget *icon, Systray *plugin) {
     g_return_if_fail(GTK_IS_WIDGET(icon));
 
     systray_names_update_icon(icon, plugin);
+    systray_icon_set_max_fps(icon, plugin);
+    systray_icon_set_suspended(icon, plugin);
+    g_signal_connect(G_OBJECT(icon), "name-changed",
+                     G_CALLBACK(systray_icon_name_changed), plugin);
+    g_signal_connect(G_OBJECT(icon), "wm-class-changed",
+                     G_CALLBACK(systray_icon_wm_class_changed), plugin);
+    g_signal_connect(G_OBJECT(icon), "snapshot-changed",
+                     G_CALLBACK(systray_icon_snapshot_changed), plugin);
+    g_signal_connect(G_OBJECT(icon), "plug-added",
+                     G_CALLBACK(systray_icon_plug_added), plugin);
     gtk_container_add(GTK_CONTAINER(plugin->box), icon);
-    gtk_widget_show(icon);
+    systray_icon_update_embed(icon, plugin);
 
     g_debug("added %s[%p] icon", systray_socket_get_name(SYSTRAY_SOCKET(icon)), icon);
 }
 
 
+static void
+systray_icons_added(SystrayManager *manager, GPtrArray *icons, Systray *plugin) {
+    guint i;
+
+    /* sort and lay out the box once for the whole batch */
+    systray_box_freeze(SYSTRAY_BOX(plugin->box));
+    for (i = 0; i < icons->len; i++) {
+        systray_icon_added(manager, g_ptr_array_index(icons, i), plugin);
+    }
+    systray_box_thaw(SYSTRAY_BOX(plugin->box));
+}
+
+
+static void
+systray_icon_plug_added(GtkSocket *socket, Systray *plugin) {
+    /* embedded by the manager, it can be shown now */
+    systray_icon_update_embed(GTK_WIDGET(socket), plugin);
+}
+
+
+static void
+systray_icon_name_changed(SystraySocket *socket, Systray *plugin) {
+    g_return_if_fail(IS_SYSTRAY(plugin));
+
+    /* the name decides about the hidden state and the sort order */
+    systray_names_update_icon(GTK_WIDGET(socket), plugin);
+    systray_icon_update_embed(GTK_WIDGET(socket), plugin);
+    systray_box_update_child(SYSTRAY_BOX(plugin->box), GTK_WIDGET(socket));
+    systray_drawer_update(plugin);
+
+    /* the real icon takes the place of the cached one */
+    if (systray_socket_get_name_known(socket)) {
+        systray_placeholders_replace(plugin, socket);
+        systray_cache_queue_save(plugin);
+    }
+}
+
+
+static void
+systray_icon_wm_class_changed(SystraySocket *socket, Systray *plugin) {
+    g_return_if_fail(IS_SYSTRAY(plugin));
+
+    /* placeholders of nameless icons are keyed by the class */
+    if (systray_socket_get_name_known(socket)) {
+        systray_placeholders_replace(plugin, socket);
+        systray_cache_queue_save(plugin);
+    }
+}
+
+
+static void
+systray_icon_snapshot_changed(SystraySocket *socket, Systray *plugin) {
+    gint x, y;
+    guint i;
+
+    if (plugin->drawer == NULL || !gtk_widget_get_visible(plugin->drawer)) {
+        return;
+    }
+
+    /* repaint the cell of the icon, which takes a new snapshot */
+    for (i = 0; i < plugin->drawer_icons->len; i++) {
+        if (g_ptr_array_index(plugin->drawer_icons, i) == socket) {
+            systray_drawer_cell(plugin, i, &x, &y);
+            gtk_widget_queue_draw_area(plugin->drawer_area, x, y, plugin->drawer_cell,
+                                       plugin->drawer_cell);
+            break;
+        }
+    }
+}
+
+
+static void
+systray_icon_update_embed(GtkWidget *icon, gpointer data) {
+    Systray *plugin = SYSTRAY(data);
+    SystraySocket *socket = SYSTRAY_SOCKET(icon);
+
+    if (!systray_socket_is_embedded(socket)) {
+        /* the manager embeds the icons of a batch as its time budget allows,
+         * only the ones it left to the tray are embedded here */
+        if (!systray_socket_is_watched(socket)) {
+            return;
+        }
+
+        /* in lazy mode, an icon is embedded when it is shown for the first time.
+         * until the name is known, it is not known if it is hidden either */
+        if (plugin->lazy_embed &&
+            (!systray_socket_get_name_known(socket) ||
+             (systray_socket_get_hidden(socket) &&
+              !systray_box_get_show_hidden(SYSTRAY_BOX(plugin->box))))) {
+            return;
+        }
+
+        if (!systray_socket_embed(socket)) {
+            return;
+        }
+    }
+
+    /* until the name is known, it is not known if the icon is hidden or
+     * where it sorts, showing it now would move it right after */
+    if (!systray_socket_get_name_known(socket)) {
+        return;
+    }
+
+    /* unembedded icons are not shown, so they get no window or allocation */
+    gtk_widget_show(icon);
+}
+
+
 static void
 systray_icon_removed(SystrayManager *manager, GtkWidget *icon, Systray *plugin) {
     g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
@@ -548,12 +1488,37 @@ systray_icon_removed(SystrayManager *manager, GtkWidget *icon, Systray *plugin)
     g_return_if_fail(GTK_IS_WIDGET(icon));
 
     /* remove the icon from the box */
+    g_signal_handlers_disconnect_by_data(G_OBJECT(icon), plugin);
     gtk_container_remove(GTK_CONTAINER(plugin->box), icon);
+    if (systray_socket_get_offscreen(SYSTRAY_SOCKET(icon))) {
+        systray_drawer_update(plugin);
+    }
 
     g_debug("removed %s[%p] icon", systray_socket_get_name(SYSTRAY_SOCKET(icon)), icon);
 }
 
 
+static void
+systray_icons_removed(SystrayManager *manager, GPtrArray *icons, Systray *plugin) {
+    guint i;
+
+    g_return_if_fail(IS_SYSTRAY_MANAGER(manager));
+    g_return_if_fail(IS_SYSTRAY(plugin));
+    g_return_if_fail(plugin->manager == manager);
+
+    for (i = 0; i < icons->len; i++) {
+        g_signal_handlers_disconnect_by_data(G_OBJECT(g_ptr_array_index(icons, i)),
+                                             plugin);
+    }
+
+    /* take them all out of the box with a single relayout */
+    systray_box_remove_children(SYSTRAY_BOX(plugin->box), icons);
+    systray_drawer_update(plugin);
+
+    g_debug("removed %u icons", icons->len);
+}
+
+
 static void
 systray_lost_selection(SystrayManager *manager, Systray *plugin) {
     GError error;
@@ -568,3 +1533,45 @@ systray_lost_selection(SystrayManager *manager, Systray *plugin) {
         "of a notification area. This area will be unused.");
 }
 
+
+gint64
+systray_get_registered_time(Systray *plugin) {
+    g_return_val_if_fail(IS_SYSTRAY(plugin), 0);
+
+    if (plugin->manager == NULL) {
+        return 0;
+    }
+
+    /* monotonic time in microseconds, see g_get_monotonic_time() */
+    return systray_manager_get_registered_time(plugin->manager);
+}
+
+
+void
+systray_get_dock_stats(Systray *plugin, guint64 *n_batches, guint64 *batch_time_max) {
+    SystrayManagerStats stats = { 0 };
+
+    g_return_if_fail(IS_SYSTRAY(plugin));
+
+    if (plugin->manager != NULL) {
+        systray_manager_get_stats(plugin->manager, &stats);
+    }
+
+    /* time in microseconds spent docking in a single main loop iteration */
+    if (n_batches != NULL) {
+        *n_batches = stats.n_dock_batches;
+    }
+    if (batch_time_max != NULL) {
+        *batch_time_max = stats.dock_time_max;
+    }
+}
+
+
+void
+systray_reset_dock_stats(Systray *plugin) {
+    g_return_if_fail(IS_SYSTRAY(plugin));
+
+    if (plugin->manager != NULL) {
+        systray_manager_reset_dock_stats(plugin->manager);
+    }
+}
@@ -41,6 +41,12 @@ GType systray_get_type(void) G_GNUC_CONST;
 
 GtkWidget *systray_new(void);
 
+gint64 systray_get_registered_time(Systray *plugin);
+
+void systray_get_dock_stats(Systray *plugin, guint64 *n_batches, guint64 *batch_time_max);
+
+void systray_reset_dock_stats(Systray *plugin);
+
 G_END_DECLS
 
 #endif /* !__SYSTRAY_H__ */